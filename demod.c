@@ -1,6 +1,7 @@
 #define _LARGEFILE64_SOURCE
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -22,22 +23,23 @@ extern char *strptime (const char *__restrict __s,
 
 
 
-static unsigned int logedMagLUT[256][256];
-
-static void LUTInit(void){
-	for(int i = 0 ; i < 256 ; i++){
-		int centered_i = i -128;
-		for(int q = 0 ; q < 256 ; q++){
-			int centered_q = q - 128;
-			unsigned int magP2 = ((centered_i * centered_i) + (centered_q * centered_q));
-			float mag = sqrtf((float)magP2);
-			if(mag > 1.0f){
-				logedMagLUT[i][q] = (int)logf(mag);
-			}else{
-				logedMagLUT[i][q] = 0;
-			}
-		}
+/*
+ * Integer part of the natural log of the magnitude of an IQ sample (0 below a magnitude of 1).
+ * It only changes when the squared magnitude crosses e^2k, so instead of a 256x256 table
+ * computed at startup it is the count of thresholds reached: the smallest squared magnitudes
+ * for which (int)logf(sqrtf(magP2)) reaches k = 1..5. Same values as the former table.
+ */
+static const unsigned int logedMagThresholds[] = { 8, 55, 404, 2981, 22027 };
+
+static inline int logedMagnitude(unsigned char I, unsigned char Q){
+	int centered_i = I - 128;
+	int centered_q = Q - 128;
+	unsigned int magP2 = ((centered_i * centered_i) + (centered_q * centered_q));
+	int logedMag = 0;
+	for(int k = 0 ; k < sizeof(logedMagThresholds) / sizeof(logedMagThresholds[0]) ; k++){
+		logedMag += (magP2 >= logedMagThresholds[k]);
 	}
+	return(logedMag);
 }
 
 typedef struct {
@@ -76,30 +78,116 @@ static void slidingWindowUpdate(SlidingWindow *w, int newData){
 	}
 }
 
+/*
+ * Same update for a window whose power-of-two size is a compile-time constant:
+ * the ring index wraps with a mask and the average is a division by a constant,
+ * which the compiler turns into shifts. Only meant to be inlined with a literal size.
+ */
+static inline __attribute__((always_inline)) void slidingWindowUpdatePow2(SlidingWindow *w, int newData, const int size){
+	w->somme -= w->data[w->index];
+	w->somme += newData;
+	w->data[w->index] = newData;
+	w->index = (w->index - 1) & (size - 1);
+	w->average = w->somme / size;
+}
+
 static void slidingWindowFree(SlidingWindow *w){
 	if(w->data){
 		free(w->data);
 	}
 }
 
-typedef void(*OutputFunction)(int , int);
+/*
+ * Noise floor of the loged power, by minimum statistics: the smallest mean loged power of the
+ * blocks received during the last NOISE_FLOOR_WINDOW_MS (much longer than a burst), kept as the
+ * minima of NOISE_FLOOR_SUBWINDOWS sub-windows. Samples are decided when the power window sum is
+ * margin above it, so that the gate follows the gain of the receiver: above the noise when the
+ * gain is high, low enough for the weak bursts when it is low. Updated once per block.
+ * A margin of 0 keeps the fixed threshold (loged power average above 1).
+ */
+#define NOISE_FLOOR_WINDOW_MS (256)
+#define NOISE_FLOOR_SUBWINDOWS (4)
+#define NOISE_FLOOR_SHIFT (8)        // Q8 loged power per sample
+#define NOISE_FLOOR_DB_PER_UNIT (8.686) // 20 log10(e), the loged magnitude being a natural log
+#define NOISE_FLOOR_DEFAULT_MARGIN_DB (10) // the gaps between bursts must stay undecided, for the start of frame idle
+#define NOISE_FLOOR_FIXED_THRESHOLD (1)
+
+typedef struct {
+	int margin;          // Q8, 0 for the fixed threshold
+	int windowSize;      // power window
+	int subwindowSamples;
+	int minima[NOISE_FLOOR_SUBWINDOWS]; // Q8, of the last sub-windows
+	int subwindow;
+	int samples;         // in the current sub-window
+	int floor;           // Q8, -1 until the first block
+	int powerLimit;      // smallest power window sum for which the samples are decided
+} NoiseFloor;
+
+static void noiseFloorSetMargin(NoiseFloor *nf, int marginDb){
+	nf->margin = (marginDb > 0) ? (int)lrint(marginDb * (1 << NOISE_FLOOR_SHIFT) / NOISE_FLOOR_DB_PER_UNIT) : 0;
+	nf->subwindow = 0;
+	nf->samples = 0;
+	for(int k = 0 ; k < NOISE_FLOOR_SUBWINDOWS ; k++){
+		nf->minima[k] = INT_MAX;
+	}
+	nf->floor = -1;
+	// average > threshold <=> somme >= (threshold + 1) * size, the loged power being >= 0
+	nf->powerLimit = (NOISE_FLOOR_FIXED_THRESHOLD + 1) * nf->windowSize;
+}
+
+static void noiseFloorInit(NoiseFloor *nf, int sampleRate, int windowSize, int marginDb){
+	nf->windowSize = windowSize;
+	nf->subwindowSamples = (int)(((long long)sampleRate * NOISE_FLOOR_WINDOW_MS) / (1000 * NOISE_FLOOR_SUBWINDOWS));
+	noiseFloorSetMargin(nf, marginDb);
+}
+
+// power is the sum of the loged power of the count samples of the block
+static void noiseFloorUpdate(NoiseFloor *nf, int power, int count){
+	if((0 == nf->margin) || (count <= 0)){
+		return;
+	}
+	int mean = (int)(((long long)power << NOISE_FLOOR_SHIFT) / count);
+	if(mean < nf->minima[nf->subwindow]){
+		nf->minima[nf->subwindow] = mean;
+	}
+	nf->samples += count;
+	int floor = INT_MAX;
+	for(int k = 0 ; k < NOISE_FLOOR_SUBWINDOWS ; k++){
+		if(nf->minima[k] < floor){
+			floor = nf->minima[k];
+		}
+	}
+	if(nf->samples >= nf->subwindowSamples){
+		nf->subwindow = (nf->subwindow + 1) % NOISE_FLOOR_SUBWINDOWS;
+		nf->minima[nf->subwindow] = INT_MAX;
+		nf->samples = 0;
+	}
+	nf->floor = floor;
+	nf->powerLimit = (int)((((long long)floor + nf->margin) * nf->windowSize + (1 << NOISE_FLOOR_SHIFT) - 1) >> NOISE_FLOOR_SHIFT);
+}
 
 typedef struct iq_sample {
 	unsigned char I;
 	unsigned char Q;
 } iq_sample;
 
-typedef struct {
+struct FMDecoder;
+
+typedef void(*FMDecoderBlockFunction)(struct FMDecoder *decoder, const iq_sample *in, int count, int *demod, int *power, int *phase, int *crossProducts);
+
+typedef struct FMDecoder {
 	SlidingWindow powerFilter;
 	SlidingWindow phaseFilter;
+	NoiseFloor    noiseFloor; // power gate
 	iq_sample     previousSample;
 	long long int sampleCount;
-	OutputFunction signalPowerCallBack;
-	OutputFunction crossProductCallBack;
-	OutputFunction outputCallBack;
 	int sampleRate;
+	int blockPower; // loged power of the last block
+	FMDecoderBlockFunction processBlock; // specialized for the window sizes at init
 } FMDecoder;
 
+static FMDecoderBlockFunction FMDecoderSelectBlockFunction(int powerFilterSize, int phaseFilterSize);
+
 void FMDecoderReset(FMDecoder *decoder){
 	decoder->previousSample.I = decoder->previousSample.Q = 128;
 }
@@ -112,65 +200,153 @@ void FMDecoderInit(FMDecoder *decoder, int sampleRate, int powerFilterSize, int
 
 	// Power threshold and filter
 	slidingWindowInit(&(decoder->powerFilter), powerFilterSize);
+	noiseFloorInit(&decoder->noiseFloor, sampleRate, powerFilterSize, NOISE_FLOOR_DEFAULT_MARGIN_DB);
 
 	decoder->sampleCount = 0LL;
-	decoder->signalPowerCallBack = NULL;
-	decoder->crossProductCallBack = NULL;
-	decoder->outputCallBack = NULL;
-#if 0
-	// 1Hz lookup table
-	// For higher frequency, simply skip some sample
-	decoder->sinusLUT = (float*)calloc(sampleRate, sizeof(float));
-	decoder->cosineLUT = (float*)calloc(sampleRate, sizeof(float));
-	for(int i = 0 ; i < sampleRate ; i++){
-		float angle = (float)i * 2 * M_PI / (float)sampleRate;
-		decoder->cosineLUT[i] = cos(angle);
-		decoder->sinusLUT[i]  = sin(angle);
-	}
-	decoder->shiftFrequency = 0;
-	decoder->shiftSkip = 0;
-	decoder->shiftIndex = 0;
-#endif
+	decoder->processBlock = FMDecoderSelectBlockFunction(powerFilterSize, phaseFilterSize);
 	decoder->sampleRate = sampleRate;
 }
 
-#if 0
-void FMDecoderSetShiftFrequency(FMDecoder *decoder, int frequency){
-	fprintf(stderr, "%s(%d)" "\n", __func__, frequency);
-	if(frequency < 0 && (-frequency > decoder->sampleRate)){
-		frequency = -decoder->sampleRate;
+/*
+ * Frequency shifter, to center the carrier of a drifting dongle: the samples are multiplied by
+ * e^(-j 2 pi frequency t), from a phase accumulator (numerically controlled oscillator) indexing
+ * a small Q14 sine table, in integer math over blocks.
+ * With automatic frequency correction, over the first AFC_WINDOW_BITS bits of each burst (the
+ * preamble) the products x[n] conj(x[n - 1]) of the shifted samples (their cross product is the
+ * imaginary part) are summed apart for the samples demodulated +1 and -1: the angle of each sum
+ * is the frequency of that tone, the carrier offset is halfway (the mean of all the samples
+ * would be pulled by the preamble having more +1 bits). When the offset is larger than the
+ * deviation, all the samples are on one side, their mean angle is used and the next bursts
+ * finish the job. Half the offset measured is corrected at each burst.
+ */
+#define SHIFTER_TABLE_BITS (10)
+#define SHIFTER_TABLE_SHIFT (14) // Q14 cosine and sine
+#define AFC_WINDOW_BITS (96)     // 0x55 bytes of the preamble
+#define AFC_MIN_SAMPLES (16)     // of each tone, for the offset to be halfway
+#define AFC_GAIN_SHIFT (1)
+#define AFC_MAX_FREQUENCY (100000)
+
+typedef struct {
+	int16_t cosine[1 << SHIFTER_TABLE_BITS];
+	int16_t sine[1 << SHIFTER_TABLE_BITS];
+	uint32_t phase;
+	uint32_t step;          // phase increment per sample, 2^32 per turn
+	int sampleRate;
+	int frequency;          // Hz, taken off the input
+	int afc;
+	int samplesPerBit;
+	int burstSamples;       // demodulated samples of the current burst
+	int idleSamples;
+	long long sums[2][2];   // +1 and -1 samples, real and imaginary parts of x[n] conj(x[n - 1])
+	int counts[2];
+	iq_sample previousSample;
+} FrequencyShifter;
+
+void FrequencyShifterSetFrequency(FrequencyShifter *fs, int frequency){
+	if(frequency < -AFC_MAX_FREQUENCY){
+		frequency = -AFC_MAX_FREQUENCY;
+	}else if(frequency > AFC_MAX_FREQUENCY){
+		frequency = AFC_MAX_FREQUENCY;
 	}
-	if(frequency > 0 && (frequency > decoder->sampleRate)){
-		frequency = decoder->sampleRate;
+	fs->frequency = frequency;
+	fs->step = (uint32_t)(((int64_t)frequency * (INT64_C(1) << 32)) / fs->sampleRate);
+}
+
+void FrequencyShifterInit(FrequencyShifter *fs, int sampleRate, int bitRate, int frequency, int afc){
+	for(int k = 0 ; k < (1 << SHIFTER_TABLE_BITS) ; k++){
+		double angle = (2.0 * M_PI * k) / (1 << SHIFTER_TABLE_BITS);
+		fs->cosine[k] = (int16_t)lrint(cos(angle) * (1 << SHIFTER_TABLE_SHIFT));
+		fs->sine[k] = (int16_t)lrint(sin(angle) * (1 << SHIFTER_TABLE_SHIFT));
+	}
+	fs->phase = 0;
+	fs->sampleRate = sampleRate;
+	fs->afc = afc;
+	fs->samplesPerBit = sampleRate / bitRate;
+	fs->burstSamples = 0;
+	fs->idleSamples = 0;
+	memset(fs->sums, 0, sizeof(fs->sums));
+	memset(fs->counts, 0, sizeof(fs->counts));
+	fs->previousSample.I = fs->previousSample.Q = 128;
+	FrequencyShifterSetFrequency(fs, frequency);
+}
+
+static inline unsigned char shiftedToUChar(int value){
+	value += 128;
+	if(value < 0){
+		value = 0;
+	}else if(value > 255){
+		value = 255;
 	}
-	decoder->shiftFrequency = frequency;
-	decoder->shiftSkip = frequency;
-	fprintf(stderr, "%s:sF=%d,sS=%d" "\n", __func__, decoder->shiftFrequency, decoder->shiftSkip);
+	return((unsigned char)value);
 }
 
 /*
- * in and out can point to the same sample
+ * Shift count samples, in and out can point to the same samples.
+ * The phase of each sample only depends on its index, the loop has no dependency between samples.
  */
-void FMDecoderShiftFrequency(FMDecoder *decoder, iq_sample *in, iq_sample *out){
-	if(decoder->shiftFrequency){
-		float a = ((float)in->I - 128.0) / 128.0; // normalize in [-1 .. 1]
-		float b = ((float)in->Q - 128.0) / 128.0; // normalize in [-1 .. 1]
-		float c = decoder->cosineLUT[decoder->shiftIndex];
-		float d = decoder->sinusLUT[decoder->shiftIndex];
-		out->I = 128 + 128.0 * (a * c - b * d);
-		out->Q = 128 + 128.0 * (a * d + b * c);
-		decoder->shiftIndex += decoder->shiftSkip;
-		if(decoder->shiftIndex < 0){
-			decoder->shiftIndex += decoder->sampleRate;
-		}
-		if(decoder->shiftIndex >= decoder->sampleRate){
-			decoder->shiftIndex -= decoder->sampleRate;
-		}
+void FrequencyShifterProcessBlock(FrequencyShifter *fs, const iq_sample *in, iq_sample *out, int count){
+	const int tableShift = 32 - SHIFTER_TABLE_BITS;
+	const int half = 1 << (SHIFTER_TABLE_SHIFT - 1);
+	const uint32_t phase = fs->phase;
+	const uint32_t step = fs->step;
+	for(int i = 0 ; i < count ; i++){
+		uint32_t index = (phase + (uint32_t)i * step) >> tableShift;
+		int c = fs->cosine[index];
+		int s = fs->sine[index];
+		int I = in[i].I - 128;
+		int Q = in[i].Q - 128;
+		// (I + jQ)(c - js)
+		out[i].I = shiftedToUChar((I * c + Q * s + half) >> SHIFTER_TABLE_SHIFT);
+		out[i].Q = shiftedToUChar((Q * c - I * s + half) >> SHIFTER_TABLE_SHIFT);
+	}
+	fs->phase = phase + (uint32_t)count * step;
+}
+
+// The preamble of the burst was measured: retune
+static void FrequencyShifterCorrect(FrequencyShifter *fs){
+	double angle;
+	if((fs->counts[0] >= AFC_MIN_SAMPLES) && (fs->counts[1] >= AFC_MIN_SAMPLES)){
+		angle = (atan2(fs->sums[0][1], fs->sums[0][0]) + atan2(fs->sums[1][1], fs->sums[1][0])) / 2.0;
 	}else{
-		*out = *in;
+		angle = atan2(fs->sums[0][1] + fs->sums[1][1], fs->sums[0][0] + fs->sums[1][0]);
+	}
+	int offset = (int)lrint((angle * fs->sampleRate) / (2.0 * M_PI));
+	FrequencyShifterSetFrequency(fs, fs->frequency + (offset >> AFC_GAIN_SHIFT));
+}
+
+/*
+ * Automatic frequency correction from count shifted samples and their demodulated values
+ * (demod[i] is 0 between the bursts).
+ */
+void FrequencyShifterTrack(FrequencyShifter *fs, const iq_sample *samples, const int *demod, int count){
+	const int windowSamples = AFC_WINDOW_BITS * fs->samplesPerBit;
+	iq_sample previous = fs->previousSample;
+	for(int i = 0 ; i < count ; i++){
+		if(demod[i]){
+			fs->idleSamples = 0;
+			if(fs->burstSamples < windowSamples){
+				int I = samples[i].I - 128;
+				int Q = samples[i].Q - 128;
+				int previousI = previous.I - 128;
+				int previousQ = previous.Q - 128;
+				int k = (demod[i] < 0);
+				fs->sums[k][0] += I * previousI + Q * previousQ;
+				fs->sums[k][1] += Q * previousI - I * previousQ;
+				fs->counts[k]++;
+				if(windowSamples == ++fs->burstSamples){
+					FrequencyShifterCorrect(fs);
+				}
+			}
+		}else if(fs->burstSamples && (++fs->idleSamples > fs->samplesPerBit)){
+			// end of the burst
+			fs->burstSamples = 0;
+			memset(fs->sums, 0, sizeof(fs->sums));
+			memset(fs->counts, 0, sizeof(fs->counts));
+		}
+		previous = samples[i];
 	}
+	fs->previousSample = previous;
 }
-#endif
 
 void FMDecoderFree(FMDecoder *decoder){
 	slidingWindowFree(&(decoder->phaseFilter));
@@ -196,42 +372,98 @@ unsigned char intToUChar(int value){
 	return((unsigned char)(value + 128));
 }
 
-static int uCharToInt(unsigned char in){
-	int result = (int)in;
-	result -= 128;
-	return(result);
-}
 
+/*
+ * Block loop, windowSize being either a literal power of two (size of both windows)
+ * or 0 for windows of any size known only at run time.
+ */
+static inline __attribute__((always_inline)) void FMDecoderProcessBlockSized(FMDecoder *decoder, const iq_sample *in, int count, int *demod, int *power, int *phase, int *crossProducts, const int windowSize){
+	const int powerLimit = decoder->noiseFloor.powerLimit;
+	int blockPower = 0;
+	for(int i = 0 ; i < count ; i++){
+		iq_sample filtered = in[i];
+
+		int logedMag = logedMagnitude(filtered.I, filtered.Q);
+		blockPower += logedMag;
+		if(windowSize){
+			slidingWindowUpdatePow2(&decoder->powerFilter, logedMag, windowSize);
+		}else{
+			slidingWindowUpdate(&decoder->powerFilter, logedMag);
+		}
 
-void FMDecoderUpdate(FMDecoder *decoder, iq_sample *new){
-	iq_sample output = {.I = 128, .Q = 128};
-	iq_sample filtered = {.I = new->I, .Q = new->Q};
-	
-	int logedMag = logedMagLUT[filtered.I][filtered.Q];
-	slidingWindowUpdate(&decoder->powerFilter, logedMag);
-	
-	int deltaPhase = crossProduct(&(decoder->previousSample), &filtered);
-	decoder->previousSample = filtered;
+		int deltaPhase = crossProduct(&(decoder->previousSample), &filtered);
+		decoder->previousSample = filtered;
 
-	slidingWindowUpdate(&(decoder->phaseFilter), deltaPhase);
-	if(decoder->crossProductCallBack){
-		decoder->crossProductCallBack(decoder->phaseFilter.average, deltaPhase);
-	}
+		if(windowSize){
+			slidingWindowUpdatePow2(&decoder->phaseFilter, deltaPhase, windowSize);
+		}else{
+			slidingWindowUpdate(&decoder->phaseFilter, deltaPhase);
+		}
+		if(phase){
+			phase[i] = decoder->phaseFilter.average;
+		}
+		if(crossProducts){
+			crossProducts[i] = deltaPhase;
+		}
 
-	if(decoder->powerFilter.average > 1){
-		if(decoder->phaseFilter.somme < 0){
-			output.I = 128 - 100;
-		}else if(decoder->phaseFilter.somme > 0){
-			output.I = 128 + 100;
+		int output = 0;
+		if(decoder->powerFilter.somme >= powerLimit){
+			if(decoder->phaseFilter.somme < 0){
+				output = -100;
+			}else if(decoder->phaseFilter.somme > 0){
+				output = +100;
+			}
 		}
-	}else{
-		output.I = 128;
+		demod[i] = output;
+		power[i] = decoder->powerFilter.average;
 	}
+	decoder->sampleCount += count;
+	decoder->blockPower = blockPower;
+}
+
+#define FMDECODER_PROCESS_BLOCK(N) \
+static void FMDecoderProcessBlock##N(FMDecoder *decoder, const iq_sample *in, int count, int *demod, int *power, int *phase, int *crossProducts){ \
+	FMDecoderProcessBlockSized(decoder, in, count, demod, power, phase, crossProducts, N); \
+}
 
-	if(decoder->outputCallBack){
-		decoder->outputCallBack(uCharToInt(output.I), decoder->powerFilter.average);
+FMDECODER_PROCESS_BLOCK(0) // any window sizes
+FMDECODER_PROCESS_BLOCK(2)
+FMDECODER_PROCESS_BLOCK(4)
+FMDECODER_PROCESS_BLOCK(8)
+FMDECODER_PROCESS_BLOCK(16)
+FMDECODER_PROCESS_BLOCK(32)
+FMDECODER_PROCESS_BLOCK(64)
+
+static FMDecoderBlockFunction FMDecoderSelectBlockFunction(int powerFilterSize, int phaseFilterSize){
+	static const struct {
+		int size;
+		FMDecoderBlockFunction processBlock;
+	} specialized[] = {
+		{  2, FMDecoderProcessBlock2 },
+		{  4, FMDecoderProcessBlock4 },
+		{  8, FMDecoderProcessBlock8 },
+		{ 16, FMDecoderProcessBlock16 },
+		{ 32, FMDecoderProcessBlock32 },
+		{ 64, FMDecoderProcessBlock64 },
+	};
+	if(powerFilterSize == phaseFilterSize){
+		for(int i = 0 ; i < sizeof(specialized) / sizeof(specialized[0]) ; i++){
+			if(specialized[i].size == powerFilterSize){
+				return(specialized[i].processBlock);
+			}
+		}
 	}
-	decoder->sampleCount++;
+	return(FMDecoderProcessBlock0);
+}
+
+/*
+ * Demodulate count samples, then move the noise floor.
+ * demod[i] is -100, 0 (not enough power) or +100, power[i] the filtered signal power.
+ * phase[i] (filtered phase) and crossProducts[i] (unfiltered phase) are only computed when not NULL.
+ */
+void FMDecoderProcessBlock(FMDecoder *decoder, const iq_sample *in, int count, int *demod, int *power, int *phase, int *crossProducts){
+	decoder->processBlock(decoder, in, count, demod, power, phase, crossProducts);
+	noiseFloorUpdate(&decoder->noiseFloor, decoder->blockPower, count);
 }
 
 typedef enum {
@@ -249,7 +481,7 @@ typedef enum {
 
 struct SerialDecoder;
 
-typedef void(*SerialDecoderCallBack)(struct SerialDecoder*);
+typedef void(*SerialDecoderCallBack)(struct SerialDecoder*, void *context);
 
 typedef struct SerialDecoder{
 	// Configuration
@@ -259,13 +491,16 @@ typedef struct SerialDecoder{
 	unsigned int expectedBits;
 	unsigned int baudrate;
 	unsigned int samplePerBit;
+	unsigned int bitPeriod; // samples per bit, 16.16 fixed point: the ratio is seldom an integer at low sample rates
+	int phaseOffset; // 16.16 fixed point, added to the sampling point of the bits
 	unsigned int idleSamples;
 
 	// Decoding
 	unsigned long long int idleSampleCounter;
-	unsigned int sampleCounter;
+	int sampleCounter; // 16.16 fixed point, samples left before the middle of the next bit
 	int bitCounter;
 	char bits[16];
+	unsigned short reliabilities[16]; // magnitude of the filtered phase where each bit was sampled
 
 	// Output decoded data
 	SerialDecoderCallBack startOfFrameCallBack;
@@ -273,6 +508,7 @@ typedef struct SerialDecoder{
 	SerialDecoderCallBack uncheckedDataCallBack;
 	// Check
 	SerialDecoderCallBack checkedDataCallBack;
+	void *callBackContext;
 
 	unsigned long long int absoluteSampleCounter;
 	unsigned long long int lastStartOfFrameSampleCounter;
@@ -293,6 +529,8 @@ void SerialDecoderInit(SerialDecoder *sd, unsigned int dataBits, int parityKind,
 	sd->expectedBits = 1 + dataBits + ((PARITY_NONE == parityKind) ? 0 : 1) + ((STOP_1_BIT == stopBits) ? 1 : 2);
 	sd->baudrate = baudRate;
 	sd->samplePerBit = sampleRate / baudRate;
+	sd->bitPeriod = (unsigned int)(((unsigned long long)sampleRate << 16) / baudRate);
+	sd->phaseOffset = 0;
 	// fprintf(stderr, "samplePerBit=%d" "\n", sd->samplePerBit);
 	sd->sampleRate = sampleRate;
 
@@ -301,6 +539,7 @@ void SerialDecoderInit(SerialDecoder *sd, unsigned int dataBits, int parityKind,
 	sd->startOfFrameCallBack = NULL;
 	sd->uncheckedDataCallBack = NULL;
 	sd->checkedDataCallBack = NULL;
+	sd->callBackContext = NULL;
 
 	sd->absoluteSampleCounter = 0ULL;
 	sd->lastStartOfFrameSampleCounter = 0ULL;
@@ -372,48 +611,86 @@ int checkData(SerialDecoder *sd){
 
 void SerialDecoderOutput(SerialDecoder *sd){
 	if(sd->uncheckedDataCallBack){
-		sd->uncheckedDataCallBack(sd);
+		sd->uncheckedDataCallBack(sd, sd->callBackContext);
 	}
 	if(sd->checkedDataCallBack){
 		if(0 == checkData(sd)){
-			sd->checkedDataCallBack(sd);
+			sd->checkedDataCallBack(sd, sd->callBackContext);
 		}
 	}
 }
 
-void SerialDecoderSOFCallBack(SerialDecoder *sd){
+void SerialDecoderSOFCallBack(SerialDecoder *sd, void *context){
 	fprintf(stderr, "\n" "%s:SOF after %llu idle samples" "\n", __func__, sd->idleSampleCounter);
 }
 
-void SerialDecoderUpdate(SerialDecoder *sd, int sample){
-	// fprintf(stderr, "%s(%14lld;%d)" "\n", __func__, sd->absoluteSampleCounter, sample);
-	if(sd->bitCounter < 0){
-		if(sample >= 0){ // 0 means no enough energy, so it treated just as >0 for idle phase
-			sd->idleSampleCounter++;
-		}else{
+/*
+ * Decode a block of demodulated samples, only looking at the samples that matter
+ * (soft, when not NULL, holds the filtered phase behind each sample, the reliability of the bits):
+ * - waiting for a start bit, the block is scanned 8 samples at a time for a negative one
+ *   (the OR of the 8 samples is then negative), the samples before it only count as idle,
+ * - within a character, the index jumps from the middle of a bit to the middle of the next.
+ * sampleCounter and the sample counters are kept as if every sample had been looked at,
+ * so that the result does not depend on the block boundaries.
+ */
+void SerialDecoderProcessBlock(SerialDecoder *sd, const int *samples, const int *soft, int count){
+	unsigned long long int base = sd->absoluteSampleCounter;
+	int i = 0;
+	while(i < count){
+		if(sd->bitCounter < 0){
+			int first = i;
+			while(i + 8 <= count){
+				int any = 0;
+				for(int k = 0 ; k < 8 ; k++){
+					any |= samples[i + k];
+				}
+				if(any < 0){
+					break;
+				}
+				i += 8;
+			}
+			while((i < count) && (samples[i] >= 0)){ // 0 means no enough energy, so it treated just as >0 for idle phase
+				i++;
+			}
+			sd->idleSampleCounter += i - first;
+			if(i == count){
+				break;
+			}
+			sd->absoluteSampleCounter = base + i;
+			// fprintf(stderr, "%s(%14lld;%d)" "\n", __func__, sd->absoluteSampleCounter, samples[i]);
 			if(sd->idleSampleCounter > (unsigned long long)sd->idleSamples){
 				sd->bitCounter = 0;
 				if(sd->idleSampleCounter > (sd->expectedBits * sd->samplePerBit * 2)){
 					if(sd->startOfFrameCallBack){
-						sd->startOfFrameCallBack(sd);
+						sd->startOfFrameCallBack(sd, sd->callBackContext);
 					}
 					sd->lastStartOfFrameSampleCounter = sd->absoluteSampleCounter;
 				}
 			}
 			sd->idleSampleCounter = 0ULL;
-			sd->sampleCounter = sd->samplePerBit / 2; // sample at middle of bit
-		}
-	}else{
-		sd->sampleCounter--;
-		if(0 == sd->sampleCounter){
-			int sampledBit = (sample > 0) ? 1 : 0;
+			// sample at middle of bit, the filtered decision lagging the edge by about a sample
+			sd->sampleCounter = (int)(sd->bitPeriod / 2) - (1 << 16) + sd->phaseOffset;
+			i++;
+		}else{
+			// the counter is decremented by a sample on each sample, the bit is sampled when it reaches 0
+			int skip = (sd->sampleCounter <= (1 << 16)) ? 1 : ((sd->sampleCounter + 0xFFFF) >> 16);
+			if(i + skip > count){
+				sd->sampleCounter -= (count - i) << 16;
+				break;
+			}
+			i += skip - 1;
+			sd->sampleCounter -= skip << 16;
+			sd->absoluteSampleCounter = base + i;
+			int sampledBit = (samples[i] > 0) ? 1 : 0;
 			if(sampledBit && (0 == sd->bitCounter)){
 				// fprintf(stderr, "Framing error" "\n");
 				SerialDecoderReset(sd);
 				sd->idleSamples = 1;
 			}else{
-				sd->sampleCounter = sd->samplePerBit; // next sample at middle of next bit
+				sd->sampleCounter += sd->bitPeriod; // next sample at middle of next bit, keeping the fraction
 				sd->bits[sd->bitCounter] = sampledBit;
+				int reliability = (soft && samples[i]) ? abs(soft[i]) : 0;
+				sd->reliabilities[sd->bitCounter] = (reliability > USHRT_MAX) ? USHRT_MAX : reliability;
 				sd->bitCounter++;
 				if(sd->bitCounter == sd->expectedBits){
 					SerialDecoderOutput(sd);
@@ -421,9 +698,10 @@ void SerialDecoderUpdate(SerialDecoder *sd, int sample){
 					sd->idleSamples = 1;
 				}
 			}
+			i++;
 		}
 	}
-	sd->absoluteSampleCounter++;
+	sd->absoluteSampleCounter = base + count;
 }
 
 #define GRUNENWALD_MAX_DATA (256)
@@ -431,6 +709,7 @@ void SerialDecoderUpdate(SerialDecoder *sd, int sample){
 typedef struct Grunenwald {
 	int offset;
 	unsigned char data[GRUNENWALD_MAX_DATA];
+	unsigned short reliabilities[GRUNENWALD_MAX_DATA][8]; // of each data bit, LSb first
 	unsigned long long startOfFrameSampleCounter;
 } Grunenwald;
 
@@ -448,19 +727,22 @@ static void GrunenwaldUpdate(Grunenwald *g, SerialDecoder *sd, unsigned char oct
 	}
 	if(g->offset < GRUNENWALD_MAX_DATA){
 		g->data[g->offset] = octet;
+		for(int i = 0 ; i < 8 ; i++){
+			g->reliabilities[g->offset][i] = sd ? sd->reliabilities[1 + i] : 0;
+		}
 		g->offset++;
 	}
 }
 
-void GrunenwaldDumpDataHex(Grunenwald *g, int start, int stop){
-	char nibbleToCharUpperCase(unsigned char nibble){
-		nibble &= 0x0F;
-		if(nibble <= 9){
-			return('0' + nibble);
-		}
-		return(('A' - 10) + nibble);
+static char nibbleToCharUpperCase(unsigned char nibble){
+	nibble &= 0x0F;
+	if(nibble <= 9){
+		return('0' + nibble);
 	}
+	return(('A' - 10) + nibble);
+}
 
+void GrunenwaldDumpDataHex(Grunenwald *g, int start, int stop){
 	unsigned char *p = g->data + start;
 	int i = (stop - start) + 1;
 	while(i-- > 0){
@@ -551,36 +833,225 @@ static void GrunenwaldDecodeVolleyball(Grunenwald *g){
 	fprintf(stdout, "st[%c %c%c%c:%c%c%c %c] [%c] sc[%c%c %c%c] 1[%c%c:%c%c] 2[%c%c:%c%c] TO[%c %c]", left_set_digit, (left_to_mask & 0x03) ? 'T' : ' ', timer[0], timer[1], timer[2], timer[3], (right_to_mask & 0x03) ? 'T' : ' ',right_set_digit, set_digit, left_score_digit_1, left_score_digit_0, right_score_digit_1, right_score_digit_0, set1[3], set1[2], set1[1], set1[0], set2[3], set2[2], set2[1], set2[0], left_to_digit, right_to_digit);
 }
 
-void GrunenwaldSOF(Grunenwald *g, SerialDecoder *sd){
-	// Analyse previous frame (if any)
+/*
+ * Check the frame received since the previous start of frame: returns -1 when it is not a
+ * valid frame, or the number of data bytes (after the kind byte) that are valid 2-of-4
+ * nibble codes.
+ */
+static int GrunenwaldCheckFrame(Grunenwald *g){
 	int length = g->offset;
 	// fprintf(stderr, "%s:length=%d, ", __func__, length);
 	if(length > 21){
 		if(memcmp(g->data + 5, "\x55\x55\x55\x55\x55\x55\x55\xF1", 8)){
 			// fprintf(stderr, ": Sync pattern not found" "\n");
 		}else{
-			int valide = 0;
 			unsigned char kind = g->data[13];
-			if((0x6A == kind) && (28 == length)){
-				printTimeStamp(g, sd);
-				GrunenwaldDumpDataHex(g, 0, 27);
-				valide = 1;
+			if(((0x6A == kind) && (28 == length)) || ((0xA5 == kind) && (70 == length))){
+				int score = 0;
+				for(int i = 14 ; i < length - 1 ; i++){
+					if(' ' != nibblesToDigit(g->data[i])){
+						score++;
+					}
+				}
+				return(score);
 			}
-			if((0xA5 == kind) && (70 == length)){
-				printTimeStamp(g, sd);
-				GrunenwaldDumpDataHex(g, 0, 69);
-				fprintf(stdout, ": ");
-				GrunenwaldDecodeVolleyball(g);
-				valide = 1;
+		}
+	}else{
+		// fprintf(stderr, ": ShortFrame:%d" "\n", g->offset);
+	}
+	return(-1);
+}
+
+/*
+ * Soft decision correction of the data bytes of a valid frame (after the kind byte, before the
+ * last one): each nibble is made of two bit pairs, 01 or 10. A pair received as 00 or 11 has one
+ * wrong bit, the least reliable of the two is flipped, the nearest valid code. Only one bit per
+ * nibble is corrected, a nibble with both pairs wrong is left as it is.
+ * Returns the number of bits flipped.
+ */
+static int GrunenwaldCorrectFrame(Grunenwald *g){
+	int corrected = 0;
+	for(int i = 14 ; i < g->offset - 1 ; i++){
+		unsigned char octet = g->data[i];
+		for(int nibble = 0 ; nibble < 8 ; nibble += 4){
+			int wrongPairs = 0;
+			int wrongPair = 0;
+			for(int pair = nibble ; pair < nibble + 4 ; pair += 2){
+				int bits = (octet >> pair) & 0x03;
+				if((0x00 == bits) || (0x03 == bits)){
+					wrongPairs++;
+					wrongPair = pair;
+				}
 			}
-			if(1 == valide){
-				fputc('\n', stdout);
+			if(1 == wrongPairs){
+				unsigned short *reliabilities = g->reliabilities[i];
+				int flip = (reliabilities[wrongPair] <= reliabilities[wrongPair + 1]) ? wrongPair : (wrongPair + 1);
+				octet ^= (1 << flip);
+				corrected++;
 			}
 		}
+		g->data[i] = octet;
+	}
+	return(corrected);
+}
+
+static void GrunenwaldPrintFrame(Grunenwald *g, SerialDecoder *sd){
+	unsigned char kind = g->data[13];
+	printTimeStamp(g, sd);
+	if(0x6A == kind){
+		GrunenwaldDumpDataHex(g, 0, 27);
 	}else{
-		// fprintf(stderr, ": ShortFrame:%d" "\n", g->offset);
+		GrunenwaldDumpDataHex(g, 0, 69);
+		fprintf(stdout, ": ");
+		GrunenwaldDecodeVolleyball(g);
 	}
-	GrunenwaldReset(g);
+	fputc('\n', stdout);
+}
+
+/*
+ * Bank of serial decoders sampling the bits at SLICER_PHASES phases, a fraction of a bit
+ * apart, so that a jittered start edge does not lose the frame.
+ * At each start of frame edge, a slicer queues the frame it has just completed, keyed by the
+ * sample its own first byte started at. The slicers reach the long idle a fraction of a bit
+ * apart, so with noise between the bursts a start bit can be a start of frame for one slicer
+ * and a plain character for another: frames are matched by their start, within a bit.
+ * Once no slicer can still complete a frame starting there (or at the end), the valid frame
+ * with the most valid nibble codes is output, the center phase winning ties.
+ */
+#define SLICER_PHASES (3)
+#define SLICER_CENTER (SLICER_PHASES / 2)
+#define SLICER_QUEUE (4)
+
+struct SlicerBank;
+
+typedef struct Slicer {
+	SerialDecoder sd;
+	Grunenwald g;
+	struct SlicerBank *bank;
+	Grunenwald frames[SLICER_QUEUE];
+	unsigned long long keys[SLICER_QUEUE];
+	int first;
+	int queued;
+} Slicer;
+
+typedef struct SlicerBank {
+	Slicer slicers[SLICER_PHASES];
+} SlicerBank;
+
+static int SlicerSameFrame(const Slicer *slicer, unsigned long long a, unsigned long long b){
+	unsigned long long tolerance = slicer->sd.samplePerBit;
+	return(((a + tolerance) >= b) && ((b + tolerance) >= a));
+}
+
+// The slicer has nothing queued for the frame started at key, but may still complete one
+static int SlicerPending(const Slicer *slicer, unsigned long long key){
+	if(slicer->queued){
+		return(0);
+	}
+	unsigned long long start = slicer->sd.lastStartOfFrameSampleCounter;
+	if(slicer->g.offset){
+		// an older frame is still in progress: wait for it, the frames are output in order
+		return((start < key) || SlicerSameFrame(slicer, start, key));
+	}
+	return(SlicerSameFrame(slicer, start, key));
+}
+
+static void SlicerBankArbitrate(SlicerBank *bank, int flush){
+	for(;;){
+		int any = 0;
+		unsigned long long key = 0;
+		for(int k = 0 ; k < SLICER_PHASES ; k++){
+			Slicer *slicer = bank->slicers + k;
+			if(slicer->queued && ((0 == any++) || (slicer->keys[slicer->first] < key))){
+				key = slicer->keys[slicer->first];
+			}
+		}
+		if(0 == any){
+			break;
+		}
+		int ready = 1;
+		for(int k = 0 ; k < SLICER_PHASES ; k++){
+			if(SlicerPending(bank->slicers + k, key)){
+				ready = 0;
+			}
+		}
+		if((0 == ready) && (0 == flush)){
+			break;
+		}
+		int bestScore = -1;
+		Slicer *best = NULL;
+		for(int k = 0 ; k < SLICER_PHASES ; k++){
+			Slicer *slicer = bank->slicers + k;
+			if(slicer->queued && SlicerSameFrame(slicer, key, slicer->keys[slicer->first])){
+				int score = GrunenwaldCheckFrame(slicer->frames + slicer->first);
+				if((score > bestScore) || ((score >= 0) && (score == bestScore) && (SLICER_CENTER == k))){
+					bestScore = score;
+					best = slicer;
+				}
+			}
+		}
+		if(best){
+			GrunenwaldCorrectFrame(best->frames + best->first);
+			GrunenwaldPrintFrame(best->frames + best->first, &best->sd);
+		}
+		for(int k = 0 ; k < SLICER_PHASES ; k++){
+			Slicer *slicer = bank->slicers + k;
+			if(slicer->queued && SlicerSameFrame(slicer, key, slicer->keys[slicer->first])){
+				slicer->first = (slicer->first + 1) % SLICER_QUEUE;
+				slicer->queued--;
+			}
+		}
+	}
+}
+
+static void serialOutputHex(SerialDecoder *sd, void *context){
+	unsigned char value = 0;
+	for(int i = 1; i <= sd->dataBits ; i++){
+		if(sd->bits[i]){
+		   value |= (1 << (i - 1));
+		}
+	}
+	// fprintf(stderr, "%02X", value);
+	GrunenwaldUpdate(&((Slicer *)context)->g, sd, value);
+}
+
+static void grunenwaldSOFCallBack(SerialDecoder *sd, void *context){
+	// fprintf(stderr, "\n" "%20llu: ", sd->absoluteSampleCounter);
+	Slicer *slicer = (Slicer *)context;
+	if(0 == slicer->g.offset){
+		return;
+	}
+	if(SLICER_QUEUE == slicer->queued){
+		SlicerBankArbitrate(slicer->bank, 1);
+	}
+	int last = (slicer->first + slicer->queued) % SLICER_QUEUE;
+	slicer->frames[last] = slicer->g;
+	slicer->keys[last] = slicer->g.startOfFrameSampleCounter;
+	slicer->queued++;
+	GrunenwaldReset(&slicer->g);
+}
+
+static void SlicerBankInit(SlicerBank *bank, int sampleRate){
+	for(int k = 0 ; k < SLICER_PHASES ; k++){
+		Slicer *slicer = bank->slicers + k;
+		SerialDecoderInit(&slicer->sd, 8, PARITY_DONT_CARE, STOP_1_BIT, 39400, sampleRate);
+		// -1/4, 0, +1/4 bit
+		slicer->sd.phaseOffset = ((k - SLICER_CENTER) * (int)slicer->sd.bitPeriod) / (2 * (SLICER_PHASES - 1));
+		slicer->sd.checkedDataCallBack = serialOutputHex;
+		slicer->sd.startOfFrameCallBack = grunenwaldSOFCallBack;
+		slicer->sd.callBackContext = slicer;
+		GrunenwaldInit(&slicer->g);
+		slicer->bank = bank;
+		slicer->first = 0;
+		slicer->queued = 0;
+	}
+}
+
+static void SlicerBankProcessBlock(SlicerBank *bank, const int *samples, const int *soft, int count){
+	for(int k = 0 ; k < SLICER_PHASES ; k++){
+		SerialDecoderProcessBlock(&bank->slicers[k].sd, samples, soft, count);
+	}
+	SlicerBankArbitrate(bank, 0);
 }
 
 #define NB_SAMPLE (1024)
@@ -593,6 +1064,9 @@ int main(int argc, char *argv[]){
 	FILE *crossProductFile = NULL;
 	int verbose = 0;
 	unsigned int sampleRate = 2048000;
+	int noiseMargin = NOISE_FLOOR_DEFAULT_MARGIN_DB;
+	int shiftFrequency = 0;
+	int afc = 0;
 	memset(&startTime, 0, sizeof(startTime));
 
 	while (1){
@@ -604,10 +1078,13 @@ int main(int argc, char *argv[]){
 		{"crossproductfile",   required_argument, 0,  'c' },
 		{"rate",    required_argument, 0,  'r' },
 		{"starttime", required_argument, 0, 't' },
+		{"snr",     required_argument, 0,  's' },
+		{"shift",   required_argument, 0,  'f' },
+		{"afc",     no_argument,       0,  'a' },
 		{NULL,         0,                 0,  0 }
 		};
 
-		int c = getopt_long(argc, argv, "i:o:p:c:r:t:", long_options, &option_index);
+		int c = getopt_long(argc, argv, "i:o:p:c:r:t:s:f:a", long_options, &option_index);
 		if (c == -1)
 		break;
 
@@ -634,6 +1111,15 @@ int main(int argc, char *argv[]){
 			case 't':
 				hasStartTime = (strptime(optarg, "%H%M%S", &startTime) != NULL);
 				break;
+			case 's':
+				noiseMargin = strtol(optarg, NULL, 0);
+			break;
+			case 'f':
+				shiftFrequency = strtol(optarg, NULL, 0);
+			break;
+			case 'a':
+				afc = 1;
+			break;
 			default:
 				break;
 		}
@@ -643,50 +1129,13 @@ int main(int argc, char *argv[]){
 	FILE *of = NULL;
 	FILE *powerFile = NULL;
 
-	Grunenwald g;
-
-	void serialOutputHex(SerialDecoder *sd){
-		unsigned char value = 0;
-		for(int i = 1; i <= sd->dataBits ; i++){
-			if(sd->bits[i]){
-			   value |= (1 << (i - 1));
-			}
-		}
-		// fprintf(stderr, "%02X", value);
-		GrunenwaldUpdate(&g, sd, value);
-	}
-
-
-	GrunenwaldInit(&g);
-
-	void grunenwaldSOFCallBack(SerialDecoder *sd){
-		// fprintf(stderr, "\n" "%20llu: ", sd->absoluteSampleCounter);
-		GrunenwaldSOF(&g, sd);
-	}
-
 	FMDecoder fm;
 	FMDecoderInit(&fm, sampleRate, 4, 4, 0);
-	SerialDecoder sd;
-	SerialDecoderInit(&sd, 8, PARITY_DONT_CARE, STOP_1_BIT, 39400, sampleRate);
-	sd.checkedDataCallBack = serialOutputHex;
-	sd.startOfFrameCallBack = grunenwaldSOFCallBack;
-
-	void outputCallBack(int I, int Q){
-		if(of){
-		iq_sample out;
-		out.I = intToUChar(I);
-		out.Q = intToUChar(Q);
-		fwrite(&out, sizeof(out), 1, of);
-		}
-		SerialDecoderUpdate(&sd, I);
-	}
-
-	void powerCallBack(int I, int Q){
-		iq_sample out;
-		out.I = intToUChar(I);
-		out.Q = intToUChar(Q);
-		fwrite(&out, sizeof(out), 1, powerFile);
-	}
+	noiseFloorSetMargin(&fm.noiseFloor, noiseMargin);
+	static SlicerBank bank;
+	SlicerBankInit(&bank, sampleRate);
+	static FrequencyShifter shifter;
+	FrequencyShifterInit(&shifter, sampleRate, 39400, shiftFrequency, afc);
 
 	if(inputFileName){
 		if(strcmp(inputFileName, "-")){
@@ -706,25 +1155,48 @@ int main(int argc, char *argv[]){
 		powerFile = fopen(powerFileName, "wb+");
 	}
 
-	LUTInit();
 	iq_sample in_sample[NB_SAMPLE];
-	fm.outputCallBack = outputCallBack;
-	if(powerFile){
-		fm.crossProductCallBack = powerCallBack;
-	}
+	iq_sample out_sample[NB_SAMPLE];
+	int demod[NB_SAMPLE];
+	int power[NB_SAMPLE];
+	int phase[NB_SAMPLE];
+	int crossProducts[NB_SAMPLE];
 
 	for(;;){
 		int lus = read(fd, in_sample, sizeof(in_sample));
 		if(lus > 0){
 			lus /= sizeof(in_sample[0]);
-			for(int i = 0 ; i < lus; i++){
-				FMDecoderUpdate(&fm, in_sample + i);
+			if(shifter.frequency || shifter.afc){
+				FrequencyShifterProcessBlock(&shifter, in_sample, in_sample, lus);
+			}
+			FMDecoderProcessBlock(&fm, in_sample, lus, demod, power, phase, powerFile ? crossProducts : NULL);
+			if(shifter.afc){
+				FrequencyShifterTrack(&shifter, in_sample, demod, lus);
 			}
+			if(of){
+				for(int i = 0 ; i < lus ; i++){
+					out_sample[i].I = intToUChar(demod[i]);
+					out_sample[i].Q = intToUChar(power[i]);
+				}
+				fwrite(out_sample, sizeof(out_sample[0]), lus, of);
+			}
+			if(powerFile){
+				for(int i = 0 ; i < lus ; i++){
+					out_sample[i].I = intToUChar(phase[i]);
+					out_sample[i].Q = intToUChar(crossProducts[i]);
+				}
+				fwrite(out_sample, sizeof(out_sample[0]), lus, powerFile);
+			}
+			SlicerBankProcessBlock(&bank, demod, phase, lus);
 		}else{
 			break;
 		}
 
 	}
+	SlicerBankArbitrate(&bank, 1);
+	if(afc){
+		fprintf(stderr, "%s: carrier offset %d Hz" "\n", argv[0], shifter.frequency);
+	}
 	FMDecoderFree(&fm);
 	close(fd);
 	if(crossProductFile){
@@ -21,22 +21,23 @@ extern char *strptime (const char *__restrict __s,
 
 
 
-static unsigned int logedMagLUT[256][256];
-
-static void LUTInit(void){
-	for(int i = 0 ; i < 256 ; i++){
-		int centered_i = i -128;
-		for(int q = 0 ; q < 256 ; q++){
-			int centered_q = q - 128;
-			unsigned int magP2 = ((centered_i * centered_i) + (centered_q * centered_q));
-			float mag = sqrtf((float)magP2);
-			if(mag > 1.0f){
-				logedMagLUT[i][q] = (int)logf(mag);
-			}else{
-				logedMagLUT[i][q] = 0;
-			}
-		}
+/*
+ * Integer part of the natural log of the magnitude of an IQ sample (0 below a magnitude of 1).
+ * It only changes when the squared magnitude crosses e^2k, so instead of a 256x256 table
+ * computed at startup it is the count of thresholds reached: the smallest squared magnitudes
+ * for which (int)logf(sqrtf(magP2)) reaches k = 1..5. Same values as the former table.
+ */
+static const unsigned int logedMagThresholds[] = { 8, 55, 404, 2981, 22027 };
+
+static inline int logedMagnitude(unsigned char I, unsigned char Q){
+	int centered_i = I - 128;
+	int centered_q = Q - 128;
+	unsigned int magP2 = ((centered_i * centered_i) + (centered_q * centered_q));
+	int logedMag = 0;
+	for(int k = 0 ; k < sizeof(logedMagThresholds) / sizeof(logedMagThresholds[0]) ; k++){
+		logedMag += (magP2 >= logedMagThresholds[k]);
 	}
+	return(logedMag);
 }
 
 typedef struct {
@@ -61,6 +62,8 @@ static void slidingWindowInit(SlidingWindow *w, int size, int initialValue){
 		w->data = NULL;
 		w->somme = initialValue;
 	}
+	w->previousSomme = w->somme;
+	w->average = initialValue;
 }
 
 static void slidingWindowUpdate(SlidingWindow *w, int newData){
@@ -76,11 +79,38 @@ static void slidingWindowUpdate(SlidingWindow *w, int newData){
 		}
 		w->average = w->somme / w->size;
 	}else{
+		w->previousSomme = w->somme;
 		w->somme = newData;
 		w->average = newData;
 	}
 }
 
+// Copy the window content, oldest first, to history[0 .. size - 1]
+static void slidingWindowGetHistory(SlidingWindow *w, int *history){
+	if(w->size > 1){
+		int index = w->index;
+		for(int k = 0 ; k < w->size ; k++){
+			history[k] = w->data[index];
+			index = (0 == index) ? (w->size - 1) : (index - 1);
+		}
+	}else{
+		history[0] = w->somme;
+	}
+}
+
+// Reload the window from history[0 .. size - 1], oldest first, with its current and previous sums
+static void slidingWindowSetHistory(SlidingWindow *w, const int *history, int somme, int previousSomme){
+	if(w->size > 1){
+		for(int k = 0 ; k < w->size ; k++){
+			w->data[w->size - 1 - k] = history[k];
+		}
+		w->index = w->size - 1;
+	}
+	w->somme = somme;
+	w->previousSomme = previousSomme;
+	w->average = somme / w->size;
+}
+
 static void slidingWindowFree(SlidingWindow *w){
 	if(w->data){
 		free(w->data);
@@ -160,7 +190,7 @@ int FMDemoderUpdate(FMDemoder *decoder, iq_sample *new, int powerThreshold){
 	iq_sample filtered = {.I = new->I, .Q = new->Q};
 	int output = 0;
 	
-	int logedMag = logedMagLUT[filtered.I][filtered.Q];
+	int logedMag = logedMagnitude(filtered.I, filtered.Q);
 	slidingWindowUpdate(&decoder->powerFilter, logedMag);
 	
 	int deltaPhase = crossProduct(&(decoder->previousSample), &filtered);
@@ -187,12 +217,235 @@ int FMDemoderUpdate(FMDemoder *decoder, iq_sample *new, int powerThreshold){
 	return output;
 }
 
+#define FMDEMODER_CHUNK (256)
+#define FMDEMODER_MAX_WINDOW (64)
+
+/*
+ * Same decisions as count calls to FMDemoderUpdate(), bit for bit, computed in passes
+ * over planar buffers the compiler can vectorize:
+ * - deinterleave and center the samples,
+ * - cross products and loged power of every sample,
+ * - prefix sums, so that each box filter output is the difference of two prefix sums,
+ * - branch-free +1/-1/0 decisions.
+ * The windows are reloaded from / stored back to the SlidingWindows, so that both
+ * functions can be mixed on the same decoder.
+ */
+void FMDemoderProcessBlock(FMDemoder *decoder, iq_sample *in, int count, int powerThreshold, int *out){
+	int phaseSize = decoder->phaseFilter.size;
+	int powerSize = decoder->powerFilter.size;
+	if((count <= 0) || (phaseSize > FMDEMODER_MAX_WINDOW) || (powerSize > FMDEMODER_MAX_WINDOW)){
+		for(int i = 0 ; i < count ; i++){
+			out[i] = FMDemoderUpdate(decoder, in + i, powerThreshold);
+		}
+		return;
+	}
+	int I[FMDEMODER_CHUNK + 1];
+	int Q[FMDEMODER_CHUNK + 1];
+	int phase[FMDEMODER_MAX_WINDOW + FMDEMODER_CHUNK];
+	int power[FMDEMODER_MAX_WINDOW + FMDEMODER_CHUNK];
+	int phasePrefix[FMDEMODER_MAX_WINDOW + FMDEMODER_CHUNK + 1];
+	int powerPrefix[FMDEMODER_MAX_WINDOW + FMDEMODER_CHUNK + 1];
+	// average > threshold <=> somme >= (threshold + 1) * size, the loged power being >= 0
+	int powerLimit = (powerThreshold + 1) * powerSize;
+
+	slidingWindowGetHistory(&decoder->phaseFilter, phase);
+	slidingWindowGetHistory(&decoder->powerFilter, power);
+	I[0] = decoder->previousSample.I - 128;
+	Q[0] = decoder->previousSample.Q - 128;
+
+	int n = 0;
+	for(int done = 0 ; done < count ; done += n){
+		n = count - done;
+		if(n > FMDEMODER_CHUNK){
+			n = FMDEMODER_CHUNK;
+		}
+		iq_sample *chunk = in + done;
+		for(int i = 0 ; i < n ; i++){
+			I[i + 1] = chunk[i].I - 128;
+			Q[i + 1] = chunk[i].Q - 128;
+		}
+		for(int i = 0 ; i < n ; i++){
+			phase[phaseSize + i] = I[i] * Q[i + 1] - Q[i] * I[i + 1];
+			power[powerSize + i] = logedMagnitude(chunk[i].I, chunk[i].Q);
+		}
+		phasePrefix[0] = 0;
+		for(int k = 0 ; k < phaseSize + n ; k++){
+			phasePrefix[k + 1] = phasePrefix[k] + phase[k];
+		}
+		powerPrefix[0] = 0;
+		for(int k = 0 ; k < powerSize + n ; k++){
+			powerPrefix[k + 1] = powerPrefix[k] + power[k];
+		}
+		int *decision = out + done;
+		for(int i = 0 ; i < n ; i++){
+			int somme = phasePrefix[phaseSize + i + 1] - phasePrefix[i + 1];
+			int previousSomme = phasePrefix[phaseSize + i] - phasePrefix[i];
+			int powerSomme = powerPrefix[powerSize + i + 1] - powerPrefix[i + 1];
+			int sign = (0 != somme) ? somme : previousSomme;
+			decision[i] = (powerSomme >= powerLimit) ? ((sign < 0) ? -1 : +1) : 0;
+		}
+		// The last samples are the history of the next chunk
+		memmove(phase, phase + n, phaseSize * sizeof(int));
+		memmove(power, power + n, powerSize * sizeof(int));
+		I[0] = I[n];
+		Q[0] = Q[n];
+	}
+	slidingWindowSetHistory(&decoder->phaseFilter, phase, phasePrefix[phaseSize + n] - phasePrefix[n], phasePrefix[phaseSize + n - 1] - phasePrefix[n - 1]);
+	slidingWindowSetHistory(&decoder->powerFilter, power, powerPrefix[powerSize + n] - powerPrefix[n], powerPrefix[powerSize + n - 1] - powerPrefix[n - 1]);
+	decoder->previousSample = in[count - 1];
+	decoder->sampleCount += count;
+}
+
 struct BitAndDuration {
 	int bitValue;
 	int bitLength;
 	uint64_t sampleCount;
 };
 
+enum Parity {
+	PARITY_NONE,
+	PARITY_EVEN,
+	PARITY_ODD,
+	PARITY_DONT_CARE
+};
+
+enum BitOrder {
+	BIT_ORDER_LSB_FIRST,
+	BIT_ORDER_MSB_FIRST
+};
+
+enum SerialDecoderState {
+	SERIAL_DECODER_STATE_WAIT_FOR_START = -1,
+};
+
+/*
+ * Runs are decoded a whole run at a time: the transition table gives, for each position in
+ * the character (SERIAL_DECODER_STATE_WAIT_FOR_START, then the start bit ... stop bit),
+ * each bit value and each run length, the position after the run, what happened to the
+ * data bits (data = ((data << shift) & keep) | set) and whether a byte was completed or a
+ * framing error found during the run.
+ * The table is built once, by running each case through serialDecoderBitStep(), the bit
+ * per bit decoder. Longer runs than the table are folded back by whole characters, a run
+ * being periodic after one character.
+ */
+#define SERIAL_DECODER_MAX_DATA_BITS (16)
+#define SERIAL_DECODER_MAX_POSITIONS (SERIAL_DECODER_MAX_DATA_BITS + 3)
+#define SERIAL_DECODER_MAX_RUN (2 * SERIAL_DECODER_MAX_POSITIONS)
+
+enum SerialDecoderEvent {
+	SERIAL_DECODER_EVENT_BYTE = 0,
+	SERIAL_DECODER_EVENT_NONE = -1,
+	SERIAL_DECODER_EVENT_FRAMING_ERROR = -2
+};
+
+struct SerialDecoderStep {
+	int8_t state;
+	int8_t event;
+	uint8_t shift;
+	uint16_t keep;
+	uint16_t set;
+};
+
+struct SerialDecoderTable {
+	enum Parity parityKind;
+	enum BitOrder bitOrder;
+	int dataBits;
+	int characterBits; // start, data, parity and stop bits
+	int maxRun;
+	struct SerialDecoderStep steps[SERIAL_DECODER_MAX_POSITIONS][2][SERIAL_DECODER_MAX_RUN + 1];
+};
+
+struct SerialDecoder {
+	const struct SerialDecoderTable *table;
+	int state;
+	uint16_t data;
+};
+
+/*
+ * One bit, on the state and on the data transform of a table step
+ */
+static int serialDecoderBitStep(const struct SerialDecoderTable *table, struct SerialDecoderStep *step, int bitValue){
+	int event = SERIAL_DECODER_EVENT_NONE;
+	if(-1 == step->state){
+		if(-1 == bitValue){
+			step->state = 0;
+			step->shift = 0;
+			step->keep = 0;
+			step->set = 0;
+		}
+		return(event);
+	}
+	if(step->state < table->dataBits){
+		if(BIT_ORDER_LSB_FIRST == table->bitOrder){
+			if(1 == bitValue){
+				step->set |= (1 << (step->state));
+			}
+		}else{
+			step->shift++;
+			step->keep <<= 1;
+			step->set <<= 1;
+			if(1 == bitValue){
+				step->set |= 1;
+			}
+		}
+	}else if((step->state == table->dataBits) && (PARITY_NONE != table->parityKind)){
+		// This should be a parity bit
+	}else{
+		// This should be a stop bit
+		event = (-1 == bitValue) ? SERIAL_DECODER_EVENT_FRAMING_ERROR : SERIAL_DECODER_EVENT_BYTE;
+		step->state = -2; // Wait for start bit
+	}
+	step->state++;
+	return(event);
+}
+
+void serialDecoderTableInit(struct SerialDecoderTable *table, int startBits, int dataBits, enum Parity parityKind, int stopBits, enum BitOrder bitOrder){
+	// one start and one stop bit are checked, the following ones are taken as idle
+	table->parityKind = parityKind;
+	table->bitOrder = bitOrder;
+	table->dataBits = (dataBits > SERIAL_DECODER_MAX_DATA_BITS) ? SERIAL_DECODER_MAX_DATA_BITS : dataBits;
+	table->characterBits = 1 + table->dataBits + ((PARITY_NONE == parityKind) ? 0 : 1) + 1;
+	table->maxRun = 2 * table->characterBits;
+	for(int position = 0 ; position < table->characterBits ; position++){
+		for(int value = 0 ; value < 2 ; value++){
+			struct SerialDecoderStep step = { .state = position - 1, .event = SERIAL_DECODER_EVENT_NONE, .shift = 0, .keep = 0xFFFF, .set = 0};
+			table->steps[position][value][0] = step;
+			for(int length = 1 ; length <= table->maxRun ; length++){
+				int event = serialDecoderBitStep(table, &step, value ? 1 : -1);
+				if(SERIAL_DECODER_EVENT_NONE != event){
+					step.event = event;
+				}
+				table->steps[position][value][length] = step;
+			}
+		}
+	}
+}
+
+void serialDecoderInit(struct SerialDecoder *decoder, const struct SerialDecoderTable *table){
+	decoder->table = table;
+	decoder->state = SERIAL_DECODER_STATE_WAIT_FOR_START;
+	decoder->data = -1;
+}
+
+/*
+ * Push a run of bitCount bits, returns the byte completed during the run, -2 on a framing
+ * error, or -1
+ */
+int serialDecoderPush(struct SerialDecoder *decoder, int bitValue, int bitCount, uint64_t startCounter){
+	// fprintf(stdout, "%s(value=%i, length=%i)" "\n", __func__, bitValue, bitCount);
+	const struct SerialDecoderTable *table = decoder->table;
+	if(bitCount <= 0){
+		return(SERIAL_DECODER_EVENT_NONE);
+	}
+	if(bitCount > table->maxRun){
+		bitCount -= table->characterBits * ((bitCount - table->maxRun + table->characterBits - 1) / table->characterBits);
+	}
+	const struct SerialDecoderStep *step = &table->steps[decoder->state + 1][1 == bitValue][bitCount];
+	decoder->data = ((decoder->data << step->shift) & step->keep) | step->set;
+	decoder->state = step->state;
+	return((SERIAL_DECODER_EVENT_BYTE == step->event) ? decoder->data : step->event);
+}
+
 struct FrameDecoder {
 	struct BitAndDuration *syncPattern;
 	int syncPatternMaxLength;
@@ -201,6 +454,7 @@ struct FrameDecoder {
 	int dataPatternMaxLength;
 	int dataPatternLength;
 	int dataStartIndex;
+	struct SerialDecoderTable serialDecoderTable;
 };
 
 struct FrameDecoder *frameDecoderAlloc(int syncPatternMaxBitLength, int dataPatternMaxBitLength){
@@ -216,6 +470,8 @@ struct FrameDecoder *frameDecoderAlloc(int syncPatternMaxBitLength, int dataPatt
 				decoder->syncPatternLength = 0;
 				decoder->dataPatternMaxLength = dataPatternMaxBitLength;
 				decoder->dataPatternLength = 0;
+				// looks like stop is actually 3 bits, but this can also be 1-stop+2-idle or 2-stop+1-idle
+				serialDecoderTableInit(&decoder->serialDecoderTable, 1, 8, PARITY_DONT_CARE, 1, BIT_ORDER_LSB_FIRST);
 			}else{
 				free(decoder->syncPattern);
 				free(decoder);
@@ -315,87 +571,6 @@ int frameDecoderMatchSyncPattern(struct FrameDecoder *decoder){
 	return(0);
 }
 
-enum Parity {
-	PARITY_NONE,
-	PARITY_EVEN,
-	PARITY_ODD,
-	PARITY_DONT_CARE
-};
-
-enum SerialDecoderState {
-	SERIAL_DECODER_STATE_WAIT_FOR_START = -1,
-};
-
-struct SerialDecoder {
-	enum Parity parityKind;
-	int parityBit;
-	int stopBits;
-	int dataBits;
-	int startBits;
-	int state;
-	int ones;
-	uint16_t data;
-};
-
-void serialDecoderInit(struct SerialDecoder *decoder, int startBits, int dataBits, enum Parity parityKind, int stopBits){
-	decoder->startBits = startBits;
-	decoder->dataBits = dataBits;
-	decoder->parityKind = parityKind;
-	decoder->stopBits = stopBits;
-	decoder->state = SERIAL_DECODER_STATE_WAIT_FOR_START;
-	decoder->data = -1;
-	decoder->ones = 0;
-}
-
-int serialDecoderPush(struct SerialDecoder *decoder, int bitValue, int bitCount, uint64_t startCounter){
-	// fprintf(stdout, "%s(value=%i, length=%i)" "\n", __func__, bitValue, bitCount);
-	int octet = -1;
-	for(int i = 0 ; i < bitCount ; i++){
-		if(-1 == decoder->state){
-			if(-1 == bitValue){
-				decoder->state = 0;
-				decoder->data = 0;
-				decoder->ones = 0;
-	// fprintf(stdout, "%s(value=%i) start detected at index=%i)" "\n", __func__, bitValue, i);
-			}
-		}else{
-			if(decoder->state < decoder->dataBits){
-				if(1 == bitValue){
-					decoder->data |= (bitValue << (decoder->state));
-					decoder->ones++;
-				}
-			}else if(decoder->state == decoder->dataBits){
-				if(PARITY_NONE == decoder->parityKind){
-					// This should be a stop bit
-					if(-1 == bitValue){
-						// fprintf(stdout, "\n" "%s@%d: Framing error @%lu, stop bit not at 1" "\n", __func__, __LINE__, startCounter);
-						octet = -2;
-					}else{
-						octet = decoder->data;
-					}
-					// fprintf(stdout, "%s@%d: decoded 0x%02X" "\n", __func__, __LINE__, decoder->data);
-					decoder->state = -2; // Wait for start bit
-				}else{
-					// This should be a parity bit
-					decoder->parityBit = bitValue;
-				}
-			}else{
-				// This should be a stop bit
-				if(-1 == bitValue){
-					// fprintf(stdout, "\n" "%s:@%d: Framing error @%lu, stop bit not at 1" "\n", __func__, __LINE__, startCounter);
-					octet = -2;
-				}else{
-					octet = decoder->data;
-				}
-				// fprintf(stdout, "%s@%d: decoded 0x%02X" "\n", __func__, __LINE__, decoder->data);
-				decoder->state = -2; // Wait for start bit
-			}
-			decoder->state++;
-		}
-	}
-	return octet;
-}
-
 #define GRUNENWALD_MAX_FRAME_BYTES (128)
 
 const unsigned char xorPattern[58] = {
@@ -459,7 +634,7 @@ const unsigned char xorPattern[58] = {
 void serialDecode(struct FrameDecoder *decoder){
 	// fprintf(stdout, "%s(firstDataSample@%lu, firstActualDataSample@%lu)" "\n", __func__, decoder->dataPattern[0].sampleCount, decoder->dataPattern[decoder->dataStartIndex].sampleCount); 
 	struct SerialDecoder serialDecoder;
-	serialDecoderInit(&serialDecoder, 1, 8, PARITY_DONT_CARE, 1); // looks like stop is actually 3 bits, but this can also be 1-stop+2-idle or 2-stop+1-idle
+	serialDecoderInit(&serialDecoder, &decoder->serialDecoderTable);
 	// Decode serial data start in [dataStartIndex .. dataPatternLength - 1]
 	int abort = 0;
 	unsigned char decodedFrame[GRUNENWALD_MAX_FRAME_BYTES];
@@ -556,6 +731,81 @@ int sampleLengthToBitLength(int length, int sampleRate, int bitRate, int *confid
 	return bitLength;
 }
 
+/*
+ * Bit rate calibration, each transmitter crystal being slightly off: the data bits of the 0x55
+ * preamble bytes alternate, making runs of one bit. The span of BAUD_ESTIMATOR_RUNS consecutive
+ * runs of about one bit (half to one and a half bit at the current rate) is that many bits.
+ * The spans of a burst are summed, and when the burst ends its rate is averaged over the
+ * bursts: once it moved by BAUD_ESTIMATOR_UPDATE_PPM, the runs are classified at it, within
+ * maxDeviation of the nominal rate.
+ */
+#define BAUD_ESTIMATOR_RUNS (8) // one 0x55 byte
+#define BAUD_ESTIMATOR_MIN_BITS (64) // measured in a burst for it to count
+#define BAUD_ESTIMATOR_AVERAGE_SHIFT (2)
+#define BAUD_ESTIMATOR_UPDATE_PPM (1000)
+#define BAUD_ESTIMATOR_DEFAULT_DEVIATION (5) // percent
+
+struct BaudEstimator {
+	unsigned int nominal;  // bit rate, 0 when not calibrated
+	int maxDeviation;      // percent
+	unsigned int estimate; // averaged over the bursts
+	int runs;              // consecutive runs of about one bit
+	int span;              // their samples
+	uint64_t burstSamples; // spans of the current burst
+	unsigned int burstBits;
+};
+
+void baudEstimatorInit(struct BaudEstimator *be, unsigned int bitRate, int maxDeviation){
+	*be = (struct BaudEstimator){ 0 };
+	if(maxDeviation > 0){
+		be->nominal = bitRate;
+		be->estimate = bitRate;
+		be->maxDeviation = maxDeviation;
+	}
+}
+
+// A run of length samples ended
+static inline void baudEstimatorRun(struct BaudEstimator *be, int length, unsigned int sampleRate, unsigned int bitRate){
+	// half a bit <= length <= one and a half bit
+	uint64_t scaled = 2 * (uint64_t)length * bitRate;
+	if((scaled >= sampleRate) && (scaled <= 3 * (uint64_t)sampleRate)){
+		be->span += length;
+		if(BAUD_ESTIMATOR_RUNS == ++be->runs){
+			be->burstSamples += be->span;
+			be->burstBits += BAUD_ESTIMATOR_RUNS;
+			be->runs = 0;
+			be->span = 0;
+		}
+	}else{
+		be->runs = 0;
+		be->span = 0;
+	}
+}
+
+// The burst ended: average its rate, returns the bit rate to classify the runs at
+static unsigned int baudEstimatorBurst(struct BaudEstimator *be, unsigned int sampleRate, unsigned int bitRate){
+	if(be->burstBits >= BAUD_ESTIMATOR_MIN_BITS){
+		int64_t measured = (int64_t)(((uint64_t)sampleRate * be->burstBits + be->burstSamples / 2) / be->burstSamples);
+		int64_t estimate = (int64_t)be->estimate + ((measured - (int64_t)be->estimate) >> BAUD_ESTIMATOR_AVERAGE_SHIFT);
+		int64_t maxOffset = ((int64_t)be->nominal * be->maxDeviation) / 100;
+		if(estimate < (int64_t)be->nominal - maxOffset){
+			estimate = (int64_t)be->nominal - maxOffset;
+		}else if(estimate > (int64_t)be->nominal + maxOffset){
+			estimate = (int64_t)be->nominal + maxOffset;
+		}
+		be->estimate = (unsigned int)estimate;
+		int64_t offset = estimate - (int64_t)bitRate;
+		if(llabs(offset) * 1000000 >= (int64_t)bitRate * BAUD_ESTIMATOR_UPDATE_PPM){
+			bitRate = be->estimate;
+		}
+	}
+	be->runs = 0;
+	be->span = 0;
+	be->burstSamples = 0;
+	be->burstBits = 0;
+	return(bitRate);
+}
+
 #define NB_SAMPLE (1024)
 
 int main(int argc, char *argv[]){
@@ -564,6 +814,7 @@ int main(int argc, char *argv[]){
 	int verbose = 0;
 	unsigned int sampleRate = 2048000;
 	unsigned int bitRate = 39400;
+	int calibration = BAUD_ESTIMATOR_DEFAULT_DEVIATION;
 
 	while (1){
 		int option_index = 0;
@@ -572,10 +823,11 @@ int main(int argc, char *argv[]){
 		{"outputfile",   required_argument, 0,  'o' },
 		{"rate",    required_argument, 0,  'r' },
 		{"starttime", required_argument, 0, 't' },
+		{"calibration", required_argument, 0, 'a' },
 		{NULL,         0,                 0,  0 }
 		};
 
-		int c = getopt_long(argc, argv, "i:o:r:t:", long_options, &option_index);
+		int c = getopt_long(argc, argv, "i:o:r:t:a:", long_options, &option_index);
 		if (c == -1)
 		break;
 
@@ -594,6 +846,9 @@ int main(int argc, char *argv[]){
 			break;
 			case 't':
 				break;
+			case 'a':
+				calibration = strtol(optarg, NULL, 0);
+			break;
 			default:
 				break;
 		}
@@ -616,7 +871,6 @@ int main(int argc, char *argv[]){
 		exit(1);
 	}
 
-	LUTInit();
 	iq_sample in_sample[NB_SAMPLE];
 
 	struct RleEncoder{
@@ -639,24 +893,37 @@ int main(int argc, char *argv[]){
 	frameDecoderAddSyncBit(frameDecoder, +1, 16);
 	// frameDecoderDumpSyncPattern(frameDecoder);
 
+	struct BaudEstimator baudEstimator;
+	baudEstimatorInit(&baudEstimator, bitRate, calibration);
+
+	int decisions[NB_SAMPLE];
 	for(;;){
 		int lus = read(fd, in_sample, sizeof(in_sample));
 		if(lus > 0){
 			lus /= sizeof(in_sample[0]);
+			long long int sampleCount = fm.sampleCount;
+			FMDemoderProcessBlock(&fm, in_sample, lus, 1, decisions);
 			for(int i = 0 ; i < lus; i++){
-				int demoded = FMDemoderUpdate(&fm, in_sample + i, 1);
-				// fprintf(stdout, "%14llu: %i -> %i" "\n", fm.sampleCount, rleEncoder.previousValue, demoded);
+				int demoded = decisions[i];
+				sampleCount++;
+				// fprintf(stdout, "%14llu: %i -> %i" "\n", sampleCount, rleEncoder.previousValue, demoded);
 				if(rleEncoder.previousValue == demoded){
 					rleEncoder.length++;
 				}else{
+					if(baudEstimator.nominal && (rleEncoder.previousValue != 0)){
+						baudEstimatorRun(&baudEstimator, rleEncoder.length, sampleRate, bitRate);
+					}
 					int confidence;
 					int bitLength = sampleLengthToBitLength(rleEncoder.length, sampleRate, bitRate, &confidence, 4);
-					// fprintf(stdout, "%14llu: %2i -> %2i, rleEncoder.length %i bitLength %i, confidence %i%c" "\n", fm.sampleCount, rleEncoder.previousValue, demoded, rleEncoder.length, bitLength, confidence, (confidence > 2) ? '!' : ' ');
+					// fprintf(stdout, "%14llu: %2i -> %2i, rleEncoder.length %i bitLength %i, confidence %i%c" "\n", sampleCount, rleEncoder.previousValue, demoded, rleEncoder.length, bitLength, confidence, (confidence > 2) ? '!' : ' ');
 					if((rleEncoder.previousValue != 0) && (confidence <= 2) && (bitLength > 0)){
-						frameDecoderUpdate(frameDecoder, rleEncoder.previousValue, bitLength, (fm.sampleCount - rleEncoder.length));
+						frameDecoderUpdate(frameDecoder, rleEncoder.previousValue, bitLength, (sampleCount - rleEncoder.length));
 					}
 					if(0 == demoded){
-						// fprintf(stdout, "%14llu: ", fm.sampleCount);
+						if(baudEstimator.nominal){
+							bitRate = baudEstimatorBurst(&baudEstimator, sampleRate, bitRate);
+						}
+						// fprintf(stdout, "%14llu: ", sampleCount);
 						frameDecoderUpdate(frameDecoder, 0, 0, 0);
 					}
 					rleEncoder.length = 1;
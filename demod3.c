@@ -1,6 +1,8 @@
 #define _LARGEFILE64_SOURCE
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <math.h>
@@ -12,6 +14,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 /* Parse S according to FORMAT and store binary time information in TP.
    The return value is a pointer to the first unparsed character in S.  */
@@ -21,22 +26,26 @@ extern char *strptime (const char *__restrict __s,
 
 
 
-static unsigned int logedMagLUT[256][256];
+/*
+ * Integer part of the natural log of the magnitude of an IQ sample (0 below a magnitude of 1).
+ * It only changes when the squared magnitude crosses e^2k, so instead of a 256x256 table
+ * computed at startup it is the count of thresholds reached: the smallest squared magnitudes
+ * for which (int)logf(sqrtf(magP2)) reaches k = 1..5. Same values as the former table.
+ */
+static const unsigned int logedMagThresholds[] = { 8, 55, 404, 2981, 22027 };
 
-static void LUTInit(void){
-	for(int i = 0 ; i < 256 ; i++){
-		int centered_i = i -128;
-		for(int q = 0 ; q < 256 ; q++){
-			int centered_q = q - 128;
-			unsigned int magP2 = ((centered_i * centered_i) + (centered_q * centered_q));
-			float mag = sqrtf((float)magP2);
-			if(mag > 1.0f){
-				logedMagLUT[i][q] = (int)logf(mag);
-			}else{
-				logedMagLUT[i][q] = 0;
-			}
-		}
+static inline int logedMagnitudeP2(unsigned int magP2){
+	int logedMag = 0;
+	for(int k = 0 ; k < sizeof(logedMagThresholds) / sizeof(logedMagThresholds[0]) ; k++){
+		logedMag += (magP2 >= logedMagThresholds[k]);
 	}
+	return(logedMag);
+}
+
+static inline int logedMagnitude(unsigned char I, unsigned char Q){
+	int centered_i = I - 128;
+	int centered_q = Q - 128;
+	return(logedMagnitudeP2((centered_i * centered_i) + (centered_q * centered_q)));
 }
 
 typedef struct {
@@ -61,6 +70,8 @@ static void slidingWindowInit(SlidingWindow *w, int size, int initialValue){
 		w->data = NULL;
 		w->somme = initialValue;
 	}
+	w->previousSomme = w->somme;
+	w->average = initialValue;
 }
 
 static void slidingWindowUpdate(SlidingWindow *w, int newData){
@@ -76,11 +87,38 @@ static void slidingWindowUpdate(SlidingWindow *w, int newData){
 		}
 		w->average = w->somme / w->size;
 	}else{
+		w->previousSomme = w->somme;
 		w->somme = newData;
 		w->average = newData;
 	}
 }
 
+// Copy the window content, oldest first, to history[0 .. size - 1]
+static void slidingWindowGetHistory(SlidingWindow *w, int *history){
+	if(w->size > 1){
+		int index = w->index;
+		for(int k = 0 ; k < w->size ; k++){
+			history[k] = w->data[index];
+			index = (0 == index) ? (w->size - 1) : (index - 1);
+		}
+	}else{
+		history[0] = w->somme;
+	}
+}
+
+// Reload the window from history[0 .. size - 1], oldest first, with its current and previous sums
+static void slidingWindowSetHistory(SlidingWindow *w, const int *history, int somme, int previousSomme){
+	if(w->size > 1){
+		for(int k = 0 ; k < w->size ; k++){
+			w->data[w->size - 1 - k] = history[k];
+		}
+		w->index = w->size - 1;
+	}
+	w->somme = somme;
+	w->previousSomme = previousSomme;
+	w->average = somme / w->size;
+}
+
 static void slidingWindowFree(SlidingWindow *w){
 	if(w->data){
 		free(w->data);
@@ -89,6 +127,85 @@ static void slidingWindowFree(SlidingWindow *w){
 
 typedef void(*OutputFunction)(int , int);
 
+/*
+ * Noise floor of the loged power, by minimum statistics: the smallest mean loged power of the
+ * blocks received during the last NOISE_FLOOR_WINDOW_MS (much longer than a burst), kept as the
+ * minima of NOISE_FLOOR_SUBWINDOWS sub-windows. Samples are decided when the power window sum is
+ * margin above it, so that the gate follows the gain of the receiver: above the noise when the
+ * gain is high, low enough for the weak bursts when it is low. Updated once per block.
+ * A margin of 0 keeps the fixed threshold (loged power average above 1).
+ * Behind the squelch, the floor is fed by the squelch with every block, demodulated or not.
+ */
+#define NOISE_FLOOR_WINDOW_MS (256)
+#define NOISE_FLOOR_SUBWINDOWS (4)
+#define NOISE_FLOOR_SHIFT (8)        // Q8 loged power per sample
+#define NOISE_FLOOR_DB_PER_UNIT (8.686) // 20 log10(e), the loged magnitude being a natural log
+#define NOISE_FLOOR_DEFAULT_MARGIN_DB (5)
+#define NOISE_FLOOR_FIXED_THRESHOLD (1)
+
+typedef struct {
+	int margin;          // Q8, 0 for the fixed threshold
+	int windowSize;      // power window
+	int subwindowSamples;
+	int minima[NOISE_FLOOR_SUBWINDOWS]; // Q8, of the last sub-windows
+	int subwindow;
+	int samples;         // in the current sub-window
+	int floor;           // Q8, -1 until the first block
+	int powerLimit;      // smallest power window sum for which the samples are decided
+	int external;        // fed by the squelch, noiseFloorUpdate() leaves it alone
+} NoiseFloor;
+
+static void noiseFloorSetMargin(NoiseFloor *nf, int marginDb){
+	nf->margin = (marginDb > 0) ? (int)lrint(marginDb * (1 << NOISE_FLOOR_SHIFT) / NOISE_FLOOR_DB_PER_UNIT) : 0;
+	nf->subwindow = 0;
+	nf->samples = 0;
+	for(int k = 0 ; k < NOISE_FLOOR_SUBWINDOWS ; k++){
+		nf->minima[k] = INT_MAX;
+	}
+	nf->floor = -1;
+	// average > threshold <=> somme >= (threshold + 1) * size, the loged power being >= 0
+	nf->powerLimit = (NOISE_FLOOR_FIXED_THRESHOLD + 1) * nf->windowSize;
+}
+
+static void noiseFloorInit(NoiseFloor *nf, int sampleRate, int windowSize, int marginDb){
+	nf->windowSize = windowSize;
+	nf->external = 0;
+	nf->subwindowSamples = (int)(((long long)sampleRate * NOISE_FLOOR_WINDOW_MS) / (1000 * NOISE_FLOOR_SUBWINDOWS));
+	noiseFloorSetMargin(nf, marginDb);
+}
+
+// power is the sum of the loged power of the count samples of the block
+static void noiseFloorFeed(NoiseFloor *nf, int power, int count){
+	if((0 == nf->margin) || (count <= 0)){
+		return;
+	}
+	int mean = (int)(((long long)power << NOISE_FLOOR_SHIFT) / count);
+	if(mean < nf->minima[nf->subwindow]){
+		nf->minima[nf->subwindow] = mean;
+	}
+	nf->samples += count;
+	int floor = INT_MAX;
+	for(int k = 0 ; k < NOISE_FLOOR_SUBWINDOWS ; k++){
+		if(nf->minima[k] < floor){
+			floor = nf->minima[k];
+		}
+	}
+	if(nf->samples >= nf->subwindowSamples){
+		nf->subwindow = (nf->subwindow + 1) % NOISE_FLOOR_SUBWINDOWS;
+		nf->minima[nf->subwindow] = INT_MAX;
+		nf->samples = 0;
+	}
+	nf->floor = floor;
+	nf->powerLimit = (int)((((long long)floor + nf->margin) * nf->windowSize + (1 << NOISE_FLOOR_SHIFT) - 1) >> NOISE_FLOOR_SHIFT);
+}
+
+// From the demodulated blocks, unless the squelch feeds the floor
+static inline void noiseFloorUpdate(NoiseFloor *nf, int power, int count){
+	if(0 == nf->external){
+		noiseFloorFeed(nf, power, count);
+	}
+}
+
 typedef struct iq_sample {
 	unsigned char I;
 	unsigned char Q;
@@ -97,6 +214,7 @@ typedef struct iq_sample {
 typedef struct {
 	SlidingWindow powerFilter;
 	SlidingWindow phaseFilter;
+	NoiseFloor    noiseFloor; // power gate
 	iq_sample     previousSample;
 	long long int sampleCount;
 	int sampleRate;
@@ -120,6 +238,7 @@ void FMDemoderInit(FMDemoder *decoder, int sampleRate, int powerFilterSize, int
 
 	// Power threshold and filter
 	slidingWindowInit(&(decoder->powerFilter), powerFilterSize, 0);
+	noiseFloorInit(&decoder->noiseFloor, sampleRate, powerFilterSize, NOISE_FLOOR_DEFAULT_MARGIN_DB);
 
 	decoder->sampleCount = 0LL;
 	decoder->sampleRate = sampleRate;
@@ -156,11 +275,11 @@ int uCharToInt(unsigned char in){
 }
 
 
-int FMDemoderUpdate(FMDemoder *decoder, iq_sample *new, int powerThreshold){
+int FMDemoderUpdate(FMDemoder *decoder, iq_sample *new, int powerLimit){
 	iq_sample filtered = {.I = new->I, .Q = new->Q};
 	int output = 0;
 	
-	int logedMag = logedMagLUT[filtered.I][filtered.Q];
+	int logedMag = logedMagnitude(filtered.I, filtered.Q);
 	slidingWindowUpdate(&decoder->powerFilter, logedMag);
 	
 	int deltaPhase = crossProduct(&(decoder->previousSample), &filtered);
@@ -168,7 +287,7 @@ int FMDemoderUpdate(FMDemoder *decoder, iq_sample *new, int powerThreshold){
 
 	slidingWindowUpdate(&(decoder->phaseFilter), deltaPhase);
 
-	if(decoder->powerFilter.average > powerThreshold){
+	if(decoder->powerFilter.somme >= powerLimit){
 		int decision = decoder->phaseFilter.somme;
 		if(0 == decision){
 			decision = decoder->phaseFilter.previousSomme;
@@ -187,132 +306,309 @@ int FMDemoderUpdate(FMDemoder *decoder, iq_sample *new, int powerThreshold){
 	return output;
 }
 
-struct BitAndDuration {
-	int bitValue;
-	int bitLength;
-	uint64_t sampleCount;
-};
-
-struct FrameDecoder {
-	struct BitAndDuration *syncPattern;
-	int syncPatternMaxLength;
-	int syncPatternLength;
-	struct BitAndDuration *dataPattern;
-	int dataPatternMaxLength;
-	int dataPatternLength;
-	int dataStartIndex;
-};
+#define FMDEMODER_CHUNK (256)
+#define FMDEMODER_MAX_WINDOW (64)
 
-struct FrameDecoder *frameDecoderAlloc(int syncPatternMaxBitLength, int dataPatternMaxBitLength){
-	struct FrameDecoder *decoder = (struct FrameDecoder*)calloc(1, sizeof(struct FrameDecoder));
-	if(decoder){
-		void *pattern = calloc(syncPatternMaxBitLength, sizeof(struct BitAndDuration));
-		if(pattern){
-			decoder->syncPattern = (struct BitAndDuration*)pattern;
-			pattern = calloc(dataPatternMaxBitLength, sizeof(struct BitAndDuration));
-			if(pattern){
-				decoder->dataPattern = (struct BitAndDuration*)pattern;
-				decoder->syncPatternMaxLength = syncPatternMaxBitLength;
-				decoder->syncPatternLength = 0;
-				decoder->dataPatternMaxLength = dataPatternMaxBitLength;
-				decoder->dataPatternLength = 0;
-			}else{
-				free(decoder->syncPattern);
-				free(decoder);
-				decoder = NULL;
+/*
+ * Same decisions as count calls to FMDemoderUpdate() with the power limit of the noise floor,
+ * bit for bit, computed in passes
+ * over planar buffers the compiler can vectorize:
+ * - deinterleave and center the samples,
+ * - cross products and loged power of every sample,
+ * - prefix sums, so that each box filter output is the difference of two prefix sums,
+ * - branch-free +1/-1/0 decisions.
+ * When soft is not NULL, the phase filter sums behind the decisions are written there too.
+ * The windows are reloaded from / stored back to the SlidingWindows, so that both
+ * functions can be mixed on the same decoder.
+ */
+void FMDemoderProcessBlock(FMDemoder *decoder, iq_sample *in, int count, int *out, int *soft){
+	int phaseSize = decoder->phaseFilter.size;
+	int powerSize = decoder->powerFilter.size;
+	int powerLimit = decoder->noiseFloor.powerLimit;
+	if((count <= 0) || (phaseSize > FMDEMODER_MAX_WINDOW) || (powerSize > FMDEMODER_MAX_WINDOW)){
+		int blockPower = 0;
+		for(int i = 0 ; i < count ; i++){
+			out[i] = FMDemoderUpdate(decoder, in + i, powerLimit);
+			blockPower += logedMagnitude(in[i].I, in[i].Q);
+			if(soft){
+				soft[i] = decoder->phaseFilter.somme;
 			}
-		}else{
-			free(decoder);
-			decoder = NULL;
 		}
+		noiseFloorUpdate(&decoder->noiseFloor, blockPower, count);
+		return;
 	}
-	return(decoder);
-};
+	int I[FMDEMODER_CHUNK + 1];
+	int Q[FMDEMODER_CHUNK + 1];
+	int phase[FMDEMODER_MAX_WINDOW + FMDEMODER_CHUNK];
+	int power[FMDEMODER_MAX_WINDOW + FMDEMODER_CHUNK];
+	int phasePrefix[FMDEMODER_MAX_WINDOW + FMDEMODER_CHUNK + 1];
+	int powerPrefix[FMDEMODER_MAX_WINDOW + FMDEMODER_CHUNK + 1];
+	int blockPower = 0;
 
-void frameDecoderFree(struct FrameDecoder *decoder){
-	if(decoder){
-		if(decoder->syncPattern){
-			free(decoder->syncPattern);
+	slidingWindowGetHistory(&decoder->phaseFilter, phase);
+	slidingWindowGetHistory(&decoder->powerFilter, power);
+	I[0] = decoder->previousSample.I - 128;
+	Q[0] = decoder->previousSample.Q - 128;
+
+	int n = 0;
+	for(int done = 0 ; done < count ; done += n){
+		n = count - done;
+		if(n > FMDEMODER_CHUNK){
+			n = FMDEMODER_CHUNK;
 		}
-		if(decoder->dataPattern){
-			free(decoder->dataPattern);
+		iq_sample *chunk = in + done;
+		for(int i = 0 ; i < n ; i++){
+			I[i + 1] = chunk[i].I - 128;
+			Q[i + 1] = chunk[i].Q - 128;
 		}
-		free(decoder);
+		for(int i = 0 ; i < n ; i++){
+			phase[phaseSize + i] = I[i] * Q[i + 1] - Q[i] * I[i + 1];
+			power[powerSize + i] = logedMagnitude(chunk[i].I, chunk[i].Q);
+		}
+		phasePrefix[0] = 0;
+		for(int k = 0 ; k < phaseSize + n ; k++){
+			phasePrefix[k + 1] = phasePrefix[k] + phase[k];
+		}
+		powerPrefix[0] = 0;
+		for(int k = 0 ; k < powerSize + n ; k++){
+			powerPrefix[k + 1] = powerPrefix[k] + power[k];
+		}
+		blockPower += powerPrefix[powerSize + n] - powerPrefix[powerSize];
+		int *decision = out + done;
+		for(int i = 0 ; i < n ; i++){
+			int somme = phasePrefix[phaseSize + i + 1] - phasePrefix[i + 1];
+			int previousSomme = phasePrefix[phaseSize + i] - phasePrefix[i];
+			int powerSomme = powerPrefix[powerSize + i + 1] - powerPrefix[i + 1];
+			int sign = (0 != somme) ? somme : previousSomme;
+			decision[i] = (powerSomme >= powerLimit) ? ((sign < 0) ? -1 : +1) : 0;
+		}
+		if(soft){
+			for(int i = 0 ; i < n ; i++){
+				soft[done + i] = phasePrefix[phaseSize + i + 1] - phasePrefix[i + 1];
+			}
+		}
+		// The last samples are the history of the next chunk
+		memmove(phase, phase + n, phaseSize * sizeof(int));
+		memmove(power, power + n, powerSize * sizeof(int));
+		I[0] = I[n];
+		Q[0] = Q[n];
 	}
+	slidingWindowSetHistory(&decoder->phaseFilter, phase, phasePrefix[phaseSize + n] - phasePrefix[n], phasePrefix[phaseSize + n - 1] - phasePrefix[n - 1]);
+	slidingWindowSetHistory(&decoder->powerFilter, power, powerPrefix[powerSize + n] - powerPrefix[n], powerPrefix[powerSize + n - 1] - powerPrefix[n - 1]);
+	decoder->previousSample = in[count - 1];
+	decoder->sampleCount += count;
+	noiseFloorUpdate(&decoder->noiseFloor, blockPower, count);
 }
 
-void frameDecoderReset(struct FrameDecoder *decoder){
-	if(decoder){
-		decoder->dataPatternLength = 0;
+/*
+ * Tone bank engine: instead of the phase difference of successive samples, the energy of each of
+ * the two FSK tones (+/- TONE_DEVIATION from the center) over a sliding window, the samples being
+ * mixed down by the tone and box filtered (a single bin DFT, non coherent detection).
+ * The window is the inverse of the tone spacing, for which each tone falls in a null of the other
+ * filter, at most 3/4 of a bit. Both tones are mixed by the same table oscillator, one being the
+ * conjugate of the other. The soft value is the energy difference, scaled down to the range of the
+ * cross product phase filter sums, the decision its sign, gated by the same loged power.
+ */
+#define TONE_DEVIATION (30000)
+#define TONE_TABLE_BITS (10)
+#define TONE_TABLE_SHIFT (12) // Q12 sine and cosine
+
+typedef struct {
+	int16_t cosine[1 << TONE_TABLE_BITS];
+	int16_t sine[1 << TONE_TABLE_BITS];
+	uint32_t phase;
+	uint32_t step;       // phase increment per sample, 2^32 per turn
+	int window;          // samples, at most FMDEMODER_MAX_WINDOW
+	int softShift;       // energy difference to soft value
+	int history[4][FMDEMODER_MAX_WINDOW]; // last mixed samples, + tone real, imaginary, - tone real, imaginary
+	int previousSoft;
+} ToneBank;
+
+void toneBankInit(ToneBank *bank, int sampleRate, int bitRate){
+	for(int k = 0 ; k < (1 << TONE_TABLE_BITS) ; k++){
+		double angle = (2.0 * M_PI * k) / (1 << TONE_TABLE_BITS);
+		bank->cosine[k] = (int16_t)lrint(cos(angle) * (1 << TONE_TABLE_SHIFT));
+		bank->sine[k] = (int16_t)lrint(sin(angle) * (1 << TONE_TABLE_SHIFT));
 	}
+	bank->phase = 0;
+	bank->step = (uint32_t)(((uint64_t)TONE_DEVIATION << 32) / sampleRate);
+	int window = (sampleRate + TONE_DEVIATION) / (2 * TONE_DEVIATION);
+	int maxWindow = (3 * sampleRate) / (4 * bitRate);
+	if(window > maxWindow){
+		window = maxWindow;
+	}
+	if(window > FMDEMODER_MAX_WINDOW){
+		window = FMDEMODER_MAX_WINDOW;
+	}
+	bank->window = (window < 1) ? 1 : window;
+	// |sum| < window * 2^(7.5 + TONE_TABLE_SHIFT), soft values below 2^17 as the phase filter sums
+	int log2Window = 0;
+	while((1 << log2Window) < bank->window){
+		log2Window++;
+	}
+	bank->softShift = 2 * (log2Window + 8 + TONE_TABLE_SHIFT) - 17;
+	memset(bank->history, 0, sizeof(bank->history));
+	bank->previousSoft = 0;
 }
 
-int frameDecoderAddSyncBit(struct FrameDecoder *decoder, int bitValue, int bitLength){
-	if(decoder->syncPatternLength < decoder->syncPatternMaxLength){
-		decoder->syncPattern[decoder->syncPatternLength++] = (struct BitAndDuration){bitValue, bitLength};
-	}else{
-		return 1;
+/*
+ * Same interface as FMDemoderProcessBlock(), the power filter, noise floor and sample count of decoder
+ * being used and updated the same way.
+ */
+void toneBankProcessBlock(ToneBank *bank, FMDemoder *decoder, iq_sample *in, int count, int *out, int *soft){
+	int window = bank->window;
+	int powerSize = decoder->powerFilter.size;
+	if((count <= 0) || (powerSize > FMDEMODER_MAX_WINDOW)){
+		return;
 	}
-	return 0;
-}
+	int mixed[4][FMDEMODER_MAX_WINDOW + FMDEMODER_CHUNK];
+	int prefix[4][FMDEMODER_MAX_WINDOW + FMDEMODER_CHUNK + 1];
+	int power[FMDEMODER_MAX_WINDOW + FMDEMODER_CHUNK];
+	int powerPrefix[FMDEMODER_MAX_WINDOW + FMDEMODER_CHUNK + 1];
+	int powerLimit = decoder->noiseFloor.powerLimit;
+	int blockPower = 0;
+	const int tableShift = 32 - TONE_TABLE_BITS;
 
-void dumpPattern(const char *title, struct BitAndDuration *pattern, int length){
-	if(title){
-		fprintf(stdout, "%s(%d): ", title, length);
-	}else{
-		fprintf(stdout, "(%d): ", length);
+	for(int t = 0 ; t < 4 ; t++){
+		memcpy(mixed[t], bank->history[t], window * sizeof(int));
 	}
-	for(int i = 0 ; i < length ; i++){
-		unsigned char bitValue = pattern[i].bitValue;
-		unsigned char bitLength = pattern[i].bitLength;
-		fprintf(stdout, "%02X.%02X|", bitValue, bitLength);
+	slidingWindowGetHistory(&decoder->powerFilter, power);
+
+	int n = 0;
+	for(int done = 0 ; done < count ; done += n){
+		n = count - done;
+		if(n > FMDEMODER_CHUNK){
+			n = FMDEMODER_CHUNK;
+		}
+		iq_sample *chunk = in + done;
+		uint32_t phase = bank->phase;
+		for(int i = 0 ; i < n ; i++){
+			int I = chunk[i].I - 128;
+			int Q = chunk[i].Q - 128;
+			int c = bank->cosine[phase >> tableShift];
+			int s = bank->sine[phase >> tableShift];
+			phase += bank->step;
+			// (I + jQ)(c -/+ js)
+			mixed[0][window + i] = I * c + Q * s;
+			mixed[1][window + i] = Q * c - I * s;
+			mixed[2][window + i] = I * c - Q * s;
+			mixed[3][window + i] = Q * c + I * s;
+			power[powerSize + i] = logedMagnitude(chunk[i].I, chunk[i].Q);
+		}
+		bank->phase = phase;
+		for(int t = 0 ; t < 4 ; t++){
+			prefix[t][0] = 0;
+			for(int k = 0 ; k < window + n ; k++){
+				prefix[t][k + 1] = prefix[t][k] + mixed[t][k];
+			}
+		}
+		powerPrefix[0] = 0;
+		for(int k = 0 ; k < powerSize + n ; k++){
+			powerPrefix[k + 1] = powerPrefix[k] + power[k];
+		}
+		blockPower += powerPrefix[powerSize + n] - powerPrefix[powerSize];
+		for(int i = 0 ; i < n ; i++){
+			int64_t energy[4];
+			for(int t = 0 ; t < 4 ; t++){
+				int64_t sum = prefix[t][window + i + 1] - prefix[t][i + 1];
+				energy[t] = sum * sum;
+			}
+			int value = (int)((energy[0] + energy[1] - energy[2] - energy[3]) >> bank->softShift);
+			int sign = (0 != value) ? value : bank->previousSoft;
+			int powerSomme = powerPrefix[powerSize + i + 1] - powerPrefix[i + 1];
+			out[done + i] = (powerSomme >= powerLimit) ? ((sign < 0) ? -1 : +1) : 0;
+			if(soft){
+				soft[done + i] = value;
+			}
+			bank->previousSoft = value;
+		}
+		for(int t = 0 ; t < 4 ; t++){
+			memmove(mixed[t], mixed[t] + n, window * sizeof(int));
+		}
+		memmove(power, power + n, powerSize * sizeof(int));
 	}
-	fputc('\n', stdout);
+	for(int t = 0 ; t < 4 ; t++){
+		memcpy(bank->history[t], mixed[t], window * sizeof(int));
+	}
+	slidingWindowSetHistory(&decoder->powerFilter, power, powerPrefix[powerSize + n] - powerPrefix[n], powerPrefix[powerSize + n - 1] - powerPrefix[n - 1]);
+	decoder->previousSample = in[count - 1];
+	decoder->sampleCount += count;
+	noiseFloorUpdate(&decoder->noiseFloor, blockPower, count);
 }
 
-void frameDecoderDumpSyncPattern(struct FrameDecoder *decoder){
-	dumpPattern("SYNC_PATTERN", decoder->syncPattern, decoder->syncPatternLength);
-}
+/*
+ * Runs of bits, as handed from the demodulator to the frame decoder, are packed in 64 bits:
+ * - bits 63..32: reliability of the first PACKED_RUN_RELIABLE_BITS bits of the run, 4 bits each
+ *   from bit 32 on (see packedRunReliability()), the following bits being taken as reliable,
+ * - bits 31..30: value, 0 for a carrier drop, 1 for +1, 2 for -1, 3 for a sync mark,
+ * - bits 29..24: length in bits (longer runs are split by the run-length encoder),
+ * - bits 23..0: first sample of the run, counted from the start of the burst (wrapping).
+ * Bits 31..24 are the symbol the sync pattern is matched on.
+ * A sync mark (length 0) tells that the preamble correlator found the end of the sync pattern,
+ * the frame starting with the first run from its sample on.
+ */
+typedef uint64_t PackedRun;
 
-int patternCompare(struct BitAndDuration *sync, struct BitAndDuration *data, int length){
-	struct BitAndDuration *syncPtr = sync;
-	struct BitAndDuration *dataPtr = data;
-	int i = 0;
-	while(i++ < length){
-		if((syncPtr->bitValue != dataPtr->bitValue)||(syncPtr->bitLength != dataPtr->bitLength)){
-			return i;
-		}
-		syncPtr++;
-		dataPtr++;
+#define PACKED_RUN_MAX_LENGTH (63)
+#define PACKED_RUN_SAMPLE_MASK (0x00FFFFFFU)
+#define PACKED_RUN_CARRIER_DROP ((PackedRun)0)
+#define PACKED_RUN_SYNC_MARK (3U << 30)
+#define PACKED_RUN_RELIABLE_BITS (8)
+#define PACKED_RUN_MAX_RELIABILITY (15)
+
+static inline PackedRun packRun(int bitValue, int bitLength, uint32_t sampleDelta){
+	uint32_t value = (0 == bitValue) ? 0 : ((bitValue > 0) ? 1 : 2);
+	if(bitLength > PACKED_RUN_MAX_LENGTH){
+		bitLength = PACKED_RUN_MAX_LENGTH;
 	}
-	return 0;
+	return((value << 30) | ((uint32_t)bitLength << 24) | (sampleDelta & PACKED_RUN_SAMPLE_MASK));
 }
 
-int frameDecoderMatchSyncPattern(struct FrameDecoder *decoder){
-	int maxOffset = decoder->dataPatternLength - decoder->syncPatternLength;
-	if(maxOffset > 0){
-		int offset = 0;
-		for(;;){
-			if(offset <= maxOffset){
-				// fprintf(stdout, "%s(): try at offset %i" "\n", __func__, offset);
-				int diffOffset = patternCompare(decoder->syncPattern, decoder->dataPattern + offset, decoder->syncPatternLength);
-				if(0 == diffOffset){
-					// fprintf(stdout, "%s(): match at offset %i" "\n", __func__, offset);
-					decoder->dataStartIndex = (offset + decoder->syncPatternLength);
-					return(1);
-				}else{
-					// fprintf(stdout, "%s(): sequences differ at offset %i" "\n", __func__, diffOffset);
-					// dumpPattern("sync: ", decoder->syncPattern, diffOffset);
-					// dumpPattern("data: ", decoder->dataPattern + offset, diffOffset);
-				}
-			}else{
-				break;
-			}
-			offset++;
-		}
+static inline PackedRun packReliableRun(int bitValue, int bitLength, uint32_t sampleDelta, uint32_t reliabilities){
+	return(packRun(bitValue, bitLength, sampleDelta) | ((PackedRun)reliabilities << 32));
+}
+
+static inline PackedRun packSyncMark(uint32_t sampleDelta){
+	return(PACKED_RUN_SYNC_MARK | (sampleDelta & PACKED_RUN_SAMPLE_MASK));
+}
+
+static inline int packedRunIsSyncMark(PackedRun run){
+	return(PACKED_RUN_SYNC_MARK == (run & PACKED_RUN_SYNC_MARK));
+}
+
+static inline int packedRunSymbol(PackedRun run){
+	return((run >> 24) & 0xFF);
+}
+
+static inline int packedRunValue(PackedRun run){
+	static const int values[4] = { 0, +1, -1, 0};
+	return(values[(run >> 30) & 0x03]);
+}
+
+static inline int packedRunLength(PackedRun run){
+	return((run >> 24) & PACKED_RUN_MAX_LENGTH);
+}
+
+static inline uint32_t packedRunSample(PackedRun run){
+	return(run & PACKED_RUN_SAMPLE_MASK);
+}
+
+static inline uint32_t packedRunReliabilities(PackedRun run){
+	return(run >> 32);
+}
+
+/*
+ * Reliability of a bit, from the phase filter sum at its middle: log2 of its magnitude (below
+ * 2^17), 0 to PACKED_RUN_MAX_RELIABILITY.
+ */
+static inline uint32_t packedRunReliability(int soft){
+	unsigned int magnitude = (unsigned int)abs(soft) >> 2;
+	uint32_t reliability = 0;
+	while(magnitude && (reliability < PACKED_RUN_MAX_RELIABILITY)){
+		magnitude >>= 1;
+		reliability++;
 	}
-	// fprintf(stdout, "%s(): NO MATCH" "\n", __func__);
-	return(0);
+	return(reliability);
 }
 
 enum Parity {
@@ -322,221 +618,717 @@ enum Parity {
 	PARITY_DONT_CARE
 };
 
+enum BitOrder {
+	BIT_ORDER_LSB_FIRST,
+	BIT_ORDER_MSB_FIRST
+};
+
 enum SerialDecoderState {
 	SERIAL_DECODER_STATE_WAIT_FOR_START = -1,
 };
 
-struct SerialDecoder {
+/*
+ * Runs are decoded a whole run at a time: the transition table gives, for each position in
+ * the character (SERIAL_DECODER_STATE_WAIT_FOR_START, then the start bit ... stop bit),
+ * each bit value and each run length, the position after the run, what happened to the
+ * data bits (data = ((data << shift) & keep) | set) and whether a byte was completed or a
+ * framing error found during the run, by which bit of the run.
+ * The table is built once, by running each case through serialDecoderBitStep(), the bit
+ * per bit decoder. Longer runs than the table are folded back by whole characters, a run
+ * being periodic after one character.
+ */
+#define SERIAL_DECODER_MAX_DATA_BITS (16)
+#define SERIAL_DECODER_MAX_POSITIONS (SERIAL_DECODER_MAX_DATA_BITS + 3)
+#define SERIAL_DECODER_MAX_RUN (2 * SERIAL_DECODER_MAX_POSITIONS)
+
+enum SerialDecoderEvent {
+	SERIAL_DECODER_EVENT_BYTE = 0,
+	SERIAL_DECODER_EVENT_NONE = -1,
+	SERIAL_DECODER_EVENT_FRAMING_ERROR = -2
+};
+
+struct SerialDecoderStep {
+	int8_t state;
+	int8_t event;
+	uint8_t eventBit; // bits of the run up to the one of the event
+	uint8_t shift;
+	uint16_t keep;
+	uint16_t set;
+};
+
+struct SerialDecoderTable {
 	enum Parity parityKind;
-	int parityBit;
-	int stopBits;
+	enum BitOrder bitOrder;
 	int dataBits;
-	int startBits;
+	int characterBits; // start, data, parity and stop bits
+	int maxRun;
+	struct SerialDecoderStep steps[SERIAL_DECODER_MAX_POSITIONS][2][SERIAL_DECODER_MAX_RUN + 1];
+};
+
+struct SerialDecoder {
+	const struct SerialDecoderTable *table;
 	int state;
-	int ones;
 	uint16_t data;
+	int eventBit; // bits of the last run pushed up to the stop bit of the byte completed
 };
 
-void serialDecoderInit(struct SerialDecoder *decoder, int startBits, int dataBits, enum Parity parityKind, int stopBits){
-	decoder->startBits = startBits;
-	decoder->dataBits = dataBits;
-	decoder->parityKind = parityKind;
-	decoder->stopBits = stopBits;
+/*
+ * One bit, on the state and on the data transform of a table step
+ */
+static int serialDecoderBitStep(const struct SerialDecoderTable *table, struct SerialDecoderStep *step, int bitValue){
+	int event = SERIAL_DECODER_EVENT_NONE;
+	if(-1 == step->state){
+		if(-1 == bitValue){
+			step->state = 0;
+			step->shift = 0;
+			step->keep = 0;
+			step->set = 0;
+		}
+		return(event);
+	}
+	if(step->state < table->dataBits){
+		if(BIT_ORDER_LSB_FIRST == table->bitOrder){
+			if(1 == bitValue){
+				step->set |= (1 << (step->state));
+			}
+		}else{
+			step->shift++;
+			step->keep <<= 1;
+			step->set <<= 1;
+			if(1 == bitValue){
+				step->set |= 1;
+			}
+		}
+	}else if((step->state == table->dataBits) && (PARITY_NONE != table->parityKind)){
+		// This should be a parity bit
+	}else{
+		// This should be a stop bit
+		event = (-1 == bitValue) ? SERIAL_DECODER_EVENT_FRAMING_ERROR : SERIAL_DECODER_EVENT_BYTE;
+		step->state = -2; // Wait for start bit
+	}
+	step->state++;
+	return(event);
+}
+
+void serialDecoderTableInit(struct SerialDecoderTable *table, int startBits, int dataBits, enum Parity parityKind, int stopBits, enum BitOrder bitOrder){
+	// one start and one stop bit are checked, the following ones are taken as idle
+	table->parityKind = parityKind;
+	table->bitOrder = bitOrder;
+	table->dataBits = (dataBits > SERIAL_DECODER_MAX_DATA_BITS) ? SERIAL_DECODER_MAX_DATA_BITS : dataBits;
+	table->characterBits = 1 + table->dataBits + ((PARITY_NONE == parityKind) ? 0 : 1) + 1;
+	table->maxRun = 2 * table->characterBits;
+	for(int position = 0 ; position < table->characterBits ; position++){
+		for(int value = 0 ; value < 2 ; value++){
+			struct SerialDecoderStep step = { .state = position - 1, .event = SERIAL_DECODER_EVENT_NONE, .eventBit = 0, .shift = 0, .keep = 0xFFFF, .set = 0};
+			table->steps[position][value][0] = step;
+			for(int length = 1 ; length <= table->maxRun ; length++){
+				int event = serialDecoderBitStep(table, &step, value ? 1 : -1);
+				if(SERIAL_DECODER_EVENT_NONE != event){
+					step.event = event;
+					step.eventBit = length;
+				}
+				table->steps[position][value][length] = step;
+			}
+		}
+	}
+}
+
+void serialDecoderInit(struct SerialDecoder *decoder, const struct SerialDecoderTable *table){
+	decoder->table = table;
 	decoder->state = SERIAL_DECODER_STATE_WAIT_FOR_START;
 	decoder->data = -1;
-	decoder->ones = 0;
+	decoder->eventBit = 0;
 }
 
+/*
+ * Push a run of bitCount bits, returns the byte completed during the run, -2 on a framing
+ * error, or -1
+ */
 int serialDecoderPush(struct SerialDecoder *decoder, int bitValue, int bitCount, uint64_t startCounter){
 	// fprintf(stdout, "%s(value=%i, length=%i)" "\n", __func__, bitValue, bitCount);
-	int octet = -1;
-	for(int i = 0 ; i < bitCount ; i++){
-		if(-1 == decoder->state){
-			if(-1 == bitValue){
-				decoder->state = 0;
-				decoder->data = 0;
-				decoder->ones = 0;
-	// fprintf(stdout, "%s(value=%i) start detected at index=%i)" "\n", __func__, bitValue, i);
-			}
-		}else{
-			if(decoder->state < decoder->dataBits){
-#ifdef __LSb_FIRST__
-				if(1 == bitValue){
-					decoder->data |= (bitValue << (decoder->state));
-					decoder->ones++;
-				}
-#else
-				decoder->data <<= 1;
-				if(1 == bitValue){
-					decoder->data |= 1;
-					decoder->ones++;
-				}
-#endif
-			}else if(decoder->state == decoder->dataBits){
-				if(PARITY_NONE == decoder->parityKind){
-					// This should be a stop bit
-					if(-1 == bitValue){
-						// fprintf(stdout, "\n" "%s@%d: Framing error @%lu, stop bit not at 1" "\n", __func__, __LINE__, startCounter);
-						octet = -2;
-					}else{
-						octet = decoder->data;
-					}
-					// fprintf(stdout, "%s@%d: decoded 0x%02X" "\n", __func__, __LINE__, decoder->data);
-					decoder->state = -2; // Wait for start bit
-				}else{
-					// This should be a parity bit
-					decoder->parityBit = bitValue;
-				}
-			}else{
-				// This should be a stop bit
-				if(-1 == bitValue){
-					// fprintf(stdout, "\n" "%s:@%d: Framing error @%lu, stop bit not at 1" "\n", __func__, __LINE__, startCounter);
-					octet = -2;
-				}else{
-					octet = decoder->data;
-				}
-				// fprintf(stdout, "%s@%d: decoded 0x%02X" "\n", __func__, __LINE__, decoder->data);
-				decoder->state = -2; // Wait for start bit
-			}
-			decoder->state++;
-		}
+	const struct SerialDecoderTable *table = decoder->table;
+	if(bitCount <= 0){
+		return(SERIAL_DECODER_EVENT_NONE);
+	}
+	int folded = 0;
+	if(bitCount > table->maxRun){
+		folded = table->characterBits * ((bitCount - table->maxRun + table->characterBits - 1) / table->characterBits);
+		bitCount -= folded;
 	}
-	return octet;
+	const struct SerialDecoderStep *step = &table->steps[decoder->state + 1][1 == bitValue][bitCount];
+	decoder->data = ((decoder->data << step->shift) & step->keep) | step->set;
+	decoder->state = step->state;
+	decoder->eventBit = folded + step->eventBit;
+	return((SERIAL_DECODER_EVENT_BYTE == step->event) ? decoder->data : step->event);
 }
 
 #define GRUNENWALD_MAX_FRAME_BYTES (128)
+#ifdef __LSb_FIRST__
+#define GRUNENWALD_BIT_ORDER BIT_ORDER_LSB_FIRST
+#else
+#define GRUNENWALD_BIT_ORDER BIT_ORDER_MSB_FIRST
+#endif
 
-const unsigned char xorPattern[58] = {
-	0, 0,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0xAA,
-	0x55,
-	0xAA,
-	0x55,
-	0xAA,
-	0xAA,
-	0xAA,
-	0x55,
-	0x55,
-	0x55,
-	0xAA,
-	0x55,
-	0x55,
-	0xAA,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0x55,
-	0, 0, 0
+/*
+ * The sync pattern is searched while the runs arrive: it is compiled into a KMP automaton
+ * over (value, length) symbols, each run received moving it by one transition, so that the
+ * cost per run is constant and the sync is known as soon as its last run is received.
+ * From then on, runs go straight to the serial decoder, and the frame is output as soon as
+ * its trailing 0xF1 byte is decoded: nothing is buffered until the carrier drops.
+ * The last FRAME_DECODER_LOOK_BACK runs before the sync are kept, for a sync mark to start
+ * the frame from one of them when a damaged preamble run kept the automaton from matching.
+ * The automaton still runs then, and takes over if it matches: the correlation peak may be a
+ * byte or two early in a long preamble, the frame is also dropped if it does not start by 0x8F.
+ */
+#define FRAME_DECODER_LOOK_BACK (64) // power of 2, runs received while the correlator confirms its peak
+#define FRAME_DECODER_MAX_ERASURES (8) // bytes lost to a framing error before the frame is given up
+#define FRAME_DECODER_BIT_HISTORY (64) // power of 2, bit reliabilities kept, a run and a character
+
+/*
+ * The scoreboard repeats each frame over several bursts: the last bursts of each kind vote
+ * per byte, a byte lost to a framing error or not received before the burst was cut not
+ * voting. A byte is decided by at least 2 votes, more than for any other value.
+ * The bytes of a damaged burst are still kept at their position (a framing error does not
+ * abort the frame), so that the frame is output as soon as the bursts agree on every byte.
+ * The content changes (score, clock): a clean burst differing from the bursts kept starts a
+ * new vote, and a vote contradicting a byte received in the damaged burst is not output.
+ */
+#define FRAME_COMBINER_MAX_DEPTH (8)
+#define FRAME_COMBINER_DEFAULT_DEPTH (3)
+#define FRAME_COMBINER_KINDS (2)
+
+static const unsigned char frameKinds[FRAME_COMBINER_KINDS] = { 0xA5, 0x56 };
+static const int frameKindLengths[FRAME_COMBINER_KINDS] = { 58, 16 }; // 0xF1 included
+
+struct FrameCombiner {
+	unsigned char frames[FRAME_COMBINER_MAX_DEPTH][GRUNENWALD_MAX_FRAME_BYTES];
+	uint8_t erased[FRAME_COMBINER_MAX_DEPTH][GRUNENWALD_MAX_FRAME_BYTES]; // or not received
+	int next;
+	int count;
 };
 
-void serialDecode(struct FrameDecoder *decoder){
-	// fprintf(stdout, "%s(firstDataSample@%lu, firstActualDataSample@%lu)" "\n", __func__, decoder->dataPattern[0].sampleCount, decoder->dataPattern[decoder->dataStartIndex].sampleCount); 
-	struct SerialDecoder serialDecoder;
-	serialDecoderInit(&serialDecoder, 1, 8, PARITY_DONT_CARE, 1); // looks like stop is actually 3 bits, but this can also be 1-stop+2-idle or 2-stop+1-idle
-	// Decode serial data start in [dataStartIndex .. dataPatternLength - 1]
-	int abort = 0;
-	unsigned char decodedFrame[GRUNENWALD_MAX_FRAME_BYTES];
-	int length = 0;
-	for(int index = decoder->dataStartIndex ; index < decoder->dataPatternLength ; index++){
-		int octet = serialDecoderPush(&serialDecoder, decoder->dataPattern[index].bitValue, decoder->dataPattern[index].bitLength, decoder->dataPattern[index].sampleCount);
-		if((0 <= octet) && (length < sizeof(decodedFrame))){
-			decodedFrame[length++] = (unsigned char)octet;
-		}else if(-2 == octet){
-			// fprintf(stdout, "Framing error detected @%lu, aborting" "\n", decoder->dataPattern[index].sampleCount);
-			abort = 1;
-			break;
+static void frameCombinerAdd(struct FrameCombiner *combiner, int depth, const unsigned char *frame, const uint8_t *erased, int length){
+	unsigned char *slot = combiner->frames[combiner->next];
+	uint8_t *slotErased = combiner->erased[combiner->next];
+	for(int i = 0 ; i < GRUNENWALD_MAX_FRAME_BYTES ; i++){
+		slot[i] = (i < length) ? frame[i] : 0;
+		slotErased[i] = (i < length) ? erased[i] : 1;
+	}
+	combiner->next = (combiner->next + 1) % depth;
+	if(combiner->count < depth){
+		combiner->count++;
+	}
+}
+
+// 1 when a byte received in both frames differs, erased may be NULL when no byte is erased
+static int frameCombinerConflict(const unsigned char *a, const uint8_t *aErased, const unsigned char *b, const uint8_t *bErased, int length){
+	for(int i = 0 ; i < length ; i++){
+		if(((NULL == aErased) || (0 == aErased[i])) && ((NULL == bErased) || (0 == bErased[i])) && (a[i] != b[i])){
+			return(1);
 		}
 	}
-	if(0 == abort){
-		// Check Frame
-		// Sync Word seams to be 0x8F
-		if(length > 3){
-			if(0xF1 == decodedFrame[length - 1]){
-				// Complet frame
-				if((0x8F == decodedFrame[0]) && (0xA5 == decodedFrame[1])){
-					// Looks like a valide frame
-					fprintf(stdout, "%s: score (l=%02d), ", __func__, length);
-					for(int i = 0 ; i < length ; i++){
-						fprintf(stdout, "%02X ", decodedFrame[i]);
-					}
-					fputc('\n', stdout);
-#ifdef __XOR__
-					fprintf(stdout, "%s: _XOR_ (l=%02d), ", __func__, length);
-					for(int i = 0 ; i < length ; i++){
-						fprintf(stdout, "%02X ", decodedFrame[i] ^ 0x55);
-					}
-					fputc('\n', stdout);
-#endif
-				}
-				if((0x8F == decodedFrame[0]) && (0x56 == decodedFrame[1])){
-					// Looks like a valide frame
-					fprintf(stdout, "%s: clock (l=%02d), ", __func__, length);
-					for(int i = 0 ; i < length ; i++){
-						fprintf(stdout, "%02X ", decodedFrame[i]);
-					}
-					fputc('\n', stdout);
-				}
-				fflush(stdout); // when running the output through a pipe, \n doesn't flush
-			}
+	return(0);
+}
+
+// Drop the bursts kept when the clean frame differs from one of them
+static void frameCombinerRestart(struct FrameCombiner *combiner, const unsigned char *frame, int length){
+	for(int j = 0 ; j < combiner->count ; j++){
+		if(frameCombinerConflict(combiner->frames[j], combiner->erased[j], frame, NULL, length)){
+			combiner->count = 0;
+			combiner->next = 0;
+			return;
 		}
 	}
 }
 
-int frameDecoderUpdate(struct FrameDecoder *decoder, int bitValue, int bitLength, uint64_t sampleCount){
-	// fprintf(stdout, "%s(%i, %i): dataPatternLength=%i" "\n", __func__, bitValue, bitLength, decoder->dataPatternLength);
-	if(0 == bitValue){
-		// try do decode what we have
-		if(frameDecoderMatchSyncPattern(decoder)){
-			serialDecode(decoder);
-			// fputc('\n', stdout);
+// Majority of the bursts kept for each of the length first bytes, returns 1 when one is undecided
+static int frameCombinerVote(const struct FrameCombiner *combiner, int length, unsigned char *frame){
+	for(int i = 0 ; i < length ; i++){
+		int bestVotes = 0;
+		int tie = 0;
+		for(int j = 0 ; j < combiner->count ; j++){
+			if(combiner->erased[j][i]){
+				continue;
+			}
+			unsigned char value = combiner->frames[j][i];
+			int votes = 0;
+			for(int k = 0 ; k < combiner->count ; k++){
+				if((0 == combiner->erased[k][i]) && (value == combiner->frames[k][i])){
+					votes++;
+				}
+			}
+			if(votes > bestVotes){
+				bestVotes = votes;
+				tie = 0;
+				frame[i] = value;
+			}else if((votes == bestVotes) && (value != frame[i])){
+				tie = 1;
+			}
 		}
-		frameDecoderReset(decoder);
-	}else{
-		if(decoder->dataPatternLength < decoder->dataPatternMaxLength){
-			decoder->dataPattern[decoder->dataPatternLength++] = (struct BitAndDuration){bitValue, bitLength, sampleCount};
+		if((bestVotes < 2) || tie){
+			return(1);
 		}
 	}
-	return 0;
+	return(0);
 }
 
-int sampleLengthToBitLength(int length, int sampleRate, int bitRate, int *confidence, int shift){
-	int evaluation = (int)(((int64_t)bitRate * (int64_t)(length << shift)) / (int64_t)sampleRate);
-	int powerOfTwo = (1 << shift);
+struct FrameDecoder {
+	uint8_t *syncPattern; // run symbols, see packedRunSymbol()
+	int syncPatternMaxLength;
+	int syncPatternLength;
+	int16_t syncSymbols[256]; // run symbol -> index among the distinct runs of the sync pattern, -1 if not in it
+	int syncSymbolCount;
+	int *syncTransitions; // [state * syncSymbolCount + symbol index], NULL until compiled
+	int syncState; // sync runs matched by the last runs received
+	PackedRun lookBack[FRAME_DECODER_LOOK_BACK];
+	unsigned int lookBackCount;
+	int markSynced; // decoding from a sync mark, the automaton did not match
+	struct SerialDecoderTable serialDecoderTable;
+	struct SerialDecoder serialDecoder;
+	unsigned char frame[GRUNENWALD_MAX_FRAME_BYTES];
+	uint8_t erased[GRUNENWALD_MAX_FRAME_BYTES]; // bytes lost to a framing error
+	uint8_t reliabilities[GRUNENWALD_MAX_FRAME_BYTES][8]; // of each data bit, by bit of the byte
+	uint8_t bitReliabilities[FRAME_DECODER_BIT_HISTORY]; // of the last bits pushed to the serial decoder
+	unsigned int bitCount; // bits pushed to the serial decoder
+	int frameLength;
+	int erasures;
+	int frameDone; // frame output or aborted, ignore the runs until the carrier drops
+	struct FrameCombiner combiners[FRAME_COMBINER_KINDS];
+	int combineDepth; // bursts voting, below 2 nothing is combined
+	unsigned int frames; // valid frames decoded
+	int silent; // count the frames without printing them
+};
+
+struct FrameDecoder *frameDecoderAlloc(int syncPatternMaxBitLength){
+	struct FrameDecoder *decoder = (struct FrameDecoder*)calloc(1, sizeof(struct FrameDecoder));
+	if(decoder){
+		decoder->syncPattern = (uint8_t*)calloc(syncPatternMaxBitLength, sizeof(uint8_t));
+		if(decoder->syncPattern){
+			decoder->syncPatternMaxLength = syncPatternMaxBitLength;
+			decoder->syncPatternLength = 0;
+			// looks like stop is actually 3 bits, but this can also be 1-stop+2-idle or 2-stop+1-idle
+			serialDecoderTableInit(&decoder->serialDecoderTable, 1, 8, PARITY_DONT_CARE, 1, GRUNENWALD_BIT_ORDER);
+			decoder->combineDepth = FRAME_COMBINER_DEFAULT_DEPTH;
+		}else{
+			free(decoder);
+			decoder = NULL;
+		}
+	}
+	return(decoder);
+};
+
+void frameDecoderFree(struct FrameDecoder *decoder){
+	if(decoder){
+		if(decoder->syncPattern){
+			free(decoder->syncPattern);
+		}
+		if(decoder->syncTransitions){
+			free(decoder->syncTransitions);
+		}
+		free(decoder);
+	}
+}
+
+void frameDecoderReset(struct FrameDecoder *decoder){
+	if(decoder){
+		decoder->syncState = 0;
+		decoder->lookBackCount = 0;
+		decoder->markSynced = 0;
+		decoder->frameLength = 0;
+		decoder->erasures = 0;
+		decoder->frameDone = 0;
+	}
+}
+
+// Bursts voting for the combined frames (see FrameCombiner), the bursts kept are dropped
+void frameDecoderSetCombineDepth(struct FrameDecoder *decoder, int depth){
+	decoder->combineDepth = (depth > FRAME_COMBINER_MAX_DEPTH) ? FRAME_COMBINER_MAX_DEPTH : depth;
+	for(int k = 0 ; k < FRAME_COMBINER_KINDS ; k++){
+		decoder->combiners[k].next = 0;
+		decoder->combiners[k].count = 0;
+	}
+}
+
+int frameDecoderAddSyncBit(struct FrameDecoder *decoder, int bitValue, int bitLength){
+	if(decoder->syncPatternLength < decoder->syncPatternMaxLength){
+		decoder->syncPattern[decoder->syncPatternLength++] = packedRunSymbol(packRun(bitValue, bitLength, 0));
+		// compiled again on the next run
+		free(decoder->syncTransitions);
+		decoder->syncTransitions = NULL;
+	}else{
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Build the KMP automaton of the sync pattern: from state k (k runs matched), a run equal
+ * to the next sync run goes to k + 1, any other one to the state reached from the longest
+ * sync prefix that is also a suffix of the k runs matched (the failure state).
+ * A run which is not in the sync pattern at all always goes back to 0.
+ */
+static int frameDecoderCompileSyncPattern(struct FrameDecoder *decoder){
+	int length = decoder->syncPatternLength;
+	decoder->syncSymbolCount = 0;
+	for(int i = 0 ; i < 256 ; i++){
+		decoder->syncSymbols[i] = -1;
+	}
+	for(int i = 0 ; i < length ; i++){
+		if(decoder->syncSymbols[decoder->syncPattern[i]] < 0){
+			decoder->syncSymbols[decoder->syncPattern[i]] = decoder->syncSymbolCount++;
+		}
+	}
+	int symbolCount = decoder->syncSymbolCount;
+	int *transitions = (int *)calloc((length + 1) * symbolCount + 1, sizeof(int));
+	if(NULL == transitions){
+		return(1);
+	}
+	int failure = 0;
+	for(int k = 0 ; k <= length ; k++){
+		int next = (k < length) ? decoder->syncSymbols[decoder->syncPattern[k]] : -1;
+		for(int symbol = 0 ; symbol < symbolCount ; symbol++){
+			if(symbol == next){
+				transitions[k * symbolCount + symbol] = k + 1;
+			}else{
+				transitions[k * symbolCount + symbol] = (0 == k) ? 0 : transitions[failure * symbolCount + symbol];
+			}
+		}
+		// failure state of k + 1
+		if((k > 0) && (next >= 0)){
+			failure = transitions[failure * symbolCount + next];
+		}
+	}
+	decoder->syncTransitions = transitions;
+	return(0);
+}
+
+void dumpPattern(const char *title, uint8_t *pattern, int length){
+	if(title){
+		fprintf(stdout, "%s(%d): ", title, length);
+	}else{
+		fprintf(stdout, "(%d): ", length);
+	}
+	for(int i = 0 ; i < length ; i++){
+		PackedRun run = (PackedRun)pattern[i] << 24;
+		unsigned char bitValue = packedRunValue(run);
+		unsigned char bitLength = packedRunLength(run);
+		fprintf(stdout, "%02X.%02X|", bitValue, bitLength);
+	}
+	fputc('\n', stdout);
+}
+
+void frameDecoderDumpSyncPattern(struct FrameDecoder *decoder){
+	dumpPattern("SYNC_PATTERN", decoder->syncPattern, decoder->syncPatternLength);
+}
+
+const unsigned char xorPattern[58] = {
+	0, 0,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0xAA,
+	0x55,
+	0xAA,
+	0x55,
+	0xAA,
+	0xAA,
+	0xAA,
+	0x55,
+	0x55,
+	0x55,
+	0xAA,
+	0x55,
+	0x55,
+	0xAA,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0x55,
+	0, 0, 0
+};
+
+static void printFrame(const char *function, const unsigned char *decodedFrame, int length){
+	if((0x8F == decodedFrame[0]) && (0xA5 == decodedFrame[1])){
+		// Looks like a valide frame
+		fprintf(stdout, "%s: score (l=%02d), ", function, length);
+		for(int i = 0 ; i < length ; i++){
+			fprintf(stdout, "%02X ", decodedFrame[i]);
+		}
+		fputc('\n', stdout);
+#ifdef __XOR__
+		fprintf(stdout, "%s: _XOR_ (l=%02d), ", function, length);
+		for(int i = 0 ; i < length ; i++){
+			fprintf(stdout, "%02X ", decodedFrame[i] ^ 0x55);
+		}
+		fputc('\n', stdout);
+#endif
+	}
+	if((0x8F == decodedFrame[0]) && (0x56 == decodedFrame[1])){
+		// Looks like a valide frame
+		fprintf(stdout, "%s: clock (l=%02d), ", function, length);
+		for(int i = 0 ; i < length ; i++){
+			fprintf(stdout, "%02X ", decodedFrame[i]);
+		}
+		fputc('\n', stdout);
+	}
+	fflush(stdout); // when running the output through a pipe, \n doesn't flush
+}
+
+/*
+ * A frame counted as valid (see --benchmark): 0x8F, a known kind at its length, 0xF1 last, and
+ * every nibble in between a 2-of-4 code (bit pairs 01 or 10).
+ */
+static int frameIsValid(const unsigned char *frame, int length){
+	if((length < 3) || (0x8F != frame[0]) || (0xF1 != frame[length - 1])){
+		return(0);
+	}
+	for(int k = 0 ; k < FRAME_COMBINER_KINDS ; k++){
+		if((frameKinds[k] == frame[1]) && (frameKindLengths[k] == length)){
+			for(int i = 2 ; i < length - 1 ; i++){
+				if(0x55 != ((frame[i] ^ (frame[i] >> 1)) & 0x55)){
+					return(0);
+				}
+			}
+			return(1);
+		}
+	}
+	return(0);
+}
+
+/*
+ * Soft decision correction of the data bytes (after the kind byte, before the last one), as in
+ * demod.c: each nibble is made of two bit pairs, 01 or 10. A pair received as 00 or 11 has one
+ * wrong bit, the least reliable of the two is flipped, the nearest valid code. Only one bit per
+ * nibble is corrected, a nibble with both pairs wrong (or an erased byte) is left as it is.
+ * Returns the number of bits flipped.
+ */
+static int frameCorrect(struct FrameDecoder *decoder){
+	int corrected = 0;
+	for(int i = 2 ; i < decoder->frameLength - 1 ; i++){
+		if(decoder->erased[i]){
+			continue;
+		}
+		unsigned char octet = decoder->frame[i];
+		for(int nibble = 0 ; nibble < 8 ; nibble += 4){
+			int wrongPairs = 0;
+			int wrongPair = 0;
+			for(int pair = nibble ; pair < nibble + 4 ; pair += 2){
+				int bits = (octet >> pair) & 0x03;
+				if((0x00 == bits) || (0x03 == bits)){
+					wrongPairs++;
+					wrongPair = pair;
+				}
+			}
+			if(1 == wrongPairs){
+				const uint8_t *reliabilities = decoder->reliabilities[i];
+				int flip = (reliabilities[wrongPair] <= reliabilities[wrongPair + 1]) ? wrongPair : (wrongPair + 1);
+				octet ^= (1 << flip);
+				corrected++;
+			}
+		}
+		decoder->frame[i] = octet;
+	}
+	return(corrected);
+}
+
+/*
+ * The burst is over (0xF1 received, too many framing errors or carrier lost): keep its bytes
+ * for the combiner of its kind, and when it is damaged, output the frame the bursts kept
+ * agree on.
+ */
+static void frameCombine(struct FrameDecoder *decoder, int complete){
+	int length = decoder->frameLength;
+	if((decoder->combineDepth < 2) || (length < 2) || decoder->erased[0] || decoder->erased[1] || (0x8F != decoder->frame[0])){
+		return;
+	}
+	for(int k = 0 ; k < FRAME_COMBINER_KINDS ; k++){
+		if(frameKinds[k] == decoder->frame[1]){
+			struct FrameCombiner *combiner = &decoder->combiners[k];
+			int clean = complete && (0 == decoder->erasures) && (frameKindLengths[k] == length);
+			if(clean){
+				frameCombinerRestart(combiner, decoder->frame, length);
+			}
+			frameCombinerAdd(combiner, decoder->combineDepth, decoder->frame, decoder->erased, length);
+			if(clean){
+				return;
+			}
+			unsigned char combined[GRUNENWALD_MAX_FRAME_BYTES];
+			int received = (length < frameKindLengths[k]) ? length : frameKindLengths[k];
+			if((0 == frameCombinerVote(combiner, frameKindLengths[k], combined)) && (0 == frameCombinerConflict(combined, NULL, decoder->frame, decoder->erased, received))){
+				decoder->frames += frameIsValid(combined, frameKindLengths[k]);
+				if(0 == decoder->silent){
+					printFrame(__func__, combined, frameKindLengths[k]);
+				}
+			}
+			return;
+		}
+	}
+}
+
+/*
+ * Push a run received after the sync to the serial decoder: a byte with a framing error is
+ * kept as erased, too many of them abort the frame, the 0xF1 byte ends it.
+ * The reliability of the data bits of each byte is kept, from those of the run (see PackedRun),
+ * for the frame to be corrected (see frameCorrect()) before it is output and combined.
+ */
+void serialDecode(struct FrameDecoder *decoder, int bitValue, int bitLength, uint32_t reliabilities, uint64_t sampleCount){
+	unsigned int first = decoder->bitCount;
+	for(int j = 0 ; j < bitLength ; j++){
+		uint32_t reliability = (j < PACKED_RUN_RELIABLE_BITS) ? ((reliabilities >> (4 * j)) & 0x0F) : PACKED_RUN_MAX_RELIABILITY;
+		decoder->bitReliabilities[(first + j) & (FRAME_DECODER_BIT_HISTORY - 1)] = reliability;
+	}
+	decoder->bitCount += bitLength;
+	int octet = serialDecoderPush(&decoder->serialDecoder, bitValue, bitLength, sampleCount);
+	if(-2 == octet){
+		// fprintf(stdout, "Framing error detected @%lu" "\n", sampleCount);
+		if(decoder->frameLength < sizeof(decoder->frame)){
+			decoder->frame[decoder->frameLength] = 0;
+			decoder->erased[decoder->frameLength++] = 1;
+		}
+		if(++decoder->erasures > FRAME_DECODER_MAX_ERASURES){
+			decoder->frameDone = 1;
+			frameCorrect(decoder);
+			frameCombine(decoder, 0);
+		}
+		return;
+	}
+	if((0 <= octet) && (decoder->frameLength < sizeof(decoder->frame))){
+		// the stop bit completed the byte, its data bits follow the start bit
+		const struct SerialDecoderTable *table = &decoder->serialDecoderTable;
+		unsigned int start = first + decoder->serialDecoder.eventBit - table->characterBits;
+		for(int d = 0 ; d < 8 ; d++){
+			int bit = (BIT_ORDER_MSB_FIRST == table->bitOrder) ? (7 - d) : d;
+			decoder->reliabilities[decoder->frameLength][bit] = decoder->bitReliabilities[(start + 1 + d) & (FRAME_DECODER_BIT_HISTORY - 1)];
+		}
+		decoder->frame[decoder->frameLength] = (unsigned char)octet;
+		decoder->erased[decoder->frameLength++] = 0;
+	}
+	if(0xF1 != octet){
+		return;
+	}
+	decoder->frameDone = 1;
+	frameCorrect(decoder);
+	unsigned char *decodedFrame = decoder->frame;
+	int length = decoder->frameLength;
+	// Check Frame
+	// Sync Word seams to be 0x8F
+	if(0 == decoder->erasures){
+		decoder->frames += frameIsValid(decodedFrame, length);
+		if((length > 3) && (0 == decoder->silent)){
+			// Complet frame
+			printFrame(__func__, decodedFrame, length);
+		}
+	}
+	frameCombine(decoder, 1);
+}
+
+static void frameDecoderMarkDecode(struct FrameDecoder *decoder, PackedRun run){
+	serialDecode(decoder, packedRunValue(run), packedRunLength(run), packedRunReliabilities(run), packedRunSample(run));
+	if((1 == decoder->frameLength) && (0x8F != decoder->frame[0])){
+		// not a frame start, back to the automaton only
+		decoder->markSynced = 0;
+		decoder->frameLength = 0;
+		decoder->erasures = 0;
+		decoder->frameDone = 0;
+	}
+}
+
+/*
+ * The sync pattern ended at sample mark: decode the runs received since then, those which
+ * started within half a bit before it included (see demodBlock()).
+ */
+static void frameDecoderSyncOnMark(struct FrameDecoder *decoder, uint32_t mark){
+	decoder->markSynced = 1;
+	decoder->frameLength = 0;
+	decoder->erasures = 0;
+	decoder->frameDone = 0;
+	serialDecoderInit(&decoder->serialDecoder, &decoder->serialDecoderTable);
+	unsigned int first = (decoder->lookBackCount > FRAME_DECODER_LOOK_BACK) ? decoder->lookBackCount - FRAME_DECODER_LOOK_BACK : 0;
+	for(unsigned int i = first ; (i < decoder->lookBackCount) && decoder->markSynced && (0 == decoder->frameDone) ; i++){
+		PackedRun run = decoder->lookBack[i & (FRAME_DECODER_LOOK_BACK - 1)];
+		if(((packedRunSample(run) - mark) & PACKED_RUN_SAMPLE_MASK) <= (PACKED_RUN_SAMPLE_MASK >> 1)){
+			frameDecoderMarkDecode(decoder, run);
+		}
+	}
+}
+
+int frameDecoderUpdate(struct FrameDecoder *decoder, PackedRun run){
+	// fprintf(stdout, "%s(%i, %i): syncState=%i" "\n", __func__, packedRunValue(run), packedRunLength(run), decoder->syncState);
+	if(PACKED_RUN_CARRIER_DROP == run){
+		if(decoder->frameLength && (0 == decoder->frameDone)){
+			frameCorrect(decoder);
+			frameCombine(decoder, 0);
+		}
+		frameDecoderReset(decoder);
+	}else if(packedRunIsSyncMark(run)){
+		// the sync automaton matched first otherwise
+		if((decoder->syncState < decoder->syncPatternLength) && (0 == decoder->markSynced)){
+			frameDecoderSyncOnMark(decoder, packedRunSample(run));
+		}
+	}else if(decoder->syncState < decoder->syncPatternLength){
+		if((NULL == decoder->syncTransitions) && frameDecoderCompileSyncPattern(decoder)){
+			return 1;
+		}
+		decoder->lookBack[decoder->lookBackCount++ & (FRAME_DECODER_LOOK_BACK - 1)] = run;
+		int symbol = decoder->syncSymbols[packedRunSymbol(run)];
+		decoder->syncState = (symbol < 0) ? 0 : decoder->syncTransitions[decoder->syncState * decoder->syncSymbolCount + symbol];
+		if(decoder->syncState == decoder->syncPatternLength){
+			serialDecoderInit(&decoder->serialDecoder, &decoder->serialDecoderTable);
+			decoder->markSynced = 0;
+			decoder->frameLength = 0;
+			decoder->erasures = 0;
+			decoder->frameDone = 0;
+		}else if(decoder->markSynced && (0 == decoder->frameDone)){
+			frameDecoderMarkDecode(decoder, run);
+		}
+	}else if(0 == decoder->frameDone){
+		serialDecode(decoder, packedRunValue(run), packedRunLength(run), packedRunReliabilities(run), packedRunSample(run));
+	}
+	return 0;
+}
+
+// Runs are read in place, from the demodulator output block or ring slot
+void frameDecoderProcessRuns(struct FrameDecoder *decoder, const PackedRun *runs, int count){
+	for(int i = 0 ; i < count ; i++){
+		frameDecoderUpdate(decoder, runs[i]);
+	}
+}
+
+int sampleLengthToBitLength(int length, int sampleRate, int bitRate, int *confidence, int shift){
+	int evaluation = (int)(((int64_t)bitRate * (int64_t)(length << shift)) / (int64_t)sampleRate);
+	int powerOfTwo = (1 << shift);
 	int half = ((powerOfTwo) >> 1) - 1;
 	int bitLength = (evaluation + half) >> shift;
 	int mask = (powerOfTwo) - 1;
@@ -545,27 +1337,1217 @@ int sampleLengthToBitLength(int length, int sampleRate, int bitRate, int *confid
 	if(remainder > half){ // MSb set
 		remainder = powerOfTwo - remainder;
 	}
-	// Confidence must be scaled down the longer the bitLength. We use a log2 function here
-	int value = bitLength;
-	int log2 = 0;
+	// Confidence must be scaled down the longer the bitLength. We use a log2 function here
+	int value = bitLength;
+	int log2 = 0;
+	for(;;){
+		value >>= 1;
+		if(value > 0){
+			log2++;
+		}else{
+			break;
+		}
+	}
+	// fprintf(stdout, "bitLength=%i, log2=%i, remainder %i -> ", bitLength, log2, remainder);
+	if(bitLength > 1){
+		remainder /= bitLength;
+	}
+	// fprintf(stdout, "%i" "\n", remainder);
+	*confidence = remainder;
+	return bitLength;
+}
+
+#define NB_SAMPLE (1024)
+#define NB_RUN (2 * NB_SAMPLE + 1 + PREAMBLE_MAX_DETECTIONS) // each sample can close a run and report a carrier drop, plus the squelch closing and the sync marks
+
+/*
+ * Symbol timing recovery, for low and fractional sample per bit ratios (down to 4 samples
+ * per bit) where run lengths can no longer be rounded to a bit count with confidence.
+ * An oscillator runs at the bit rate, its phase wrapping once per bit, at the middle of
+ * the bit. Every sign change of the phase filter sum is located between its two samples
+ * by linear interpolation: the phase of the oscillator at that instant should be half a
+ * bit, the difference steers the oscillator (proportional and integral corrections, the
+ * first edge after the carrier comes up setting the phase at once).
+ * Bits are sliced where the phase wraps, on the interpolated phase filter sum.
+ */
+#define CLOCK_RECOVERY_MAX_SAMPLE_PER_BIT (16) // used by default below this ratio, run lengths are measured above
+#define CLOCK_RECOVERY_HALF_BIT (0x80000000U)
+
+struct ClockRecovery {
+	uint32_t phase;       // 2^32 per bit, 0 at the middle of a bit
+	uint32_t nominalStep; // phase increment per sample at the nominal bit rate
+	int32_t stepOffset;   // integral correction, bit rate error
+	int32_t maxStepOffset;
+	int previousSoft;
+	int previousDecision;
+	int edges;            // edges seen since the carrier came up
+};
+
+void clockRecoverySetRates(struct ClockRecovery *cr, unsigned int sampleRate, unsigned int bitRate){
+	cr->nominalStep = (uint32_t)(((uint64_t)bitRate << 32) / sampleRate);
+	cr->maxStepOffset = cr->nominalStep / 32; // track bit rates within 3%
+}
+
+void clockRecoveryInit(struct ClockRecovery *cr, unsigned int sampleRate, unsigned int bitRate){
+	clockRecoverySetRates(cr, sampleRate, bitRate);
+	cr->phase = 0;
+	cr->stepOffset = 0;
+	cr->previousSoft = 0;
+	cr->previousDecision = 0;
+	cr->edges = 0;
+}
+
+/*
+ * Slice count samples, given their decisions and phase filter sums. Bits (+1/-1, 0 while
+ * there is no carrier) are written to bits[], along with the sample they were sliced at and
+ * the interpolated phase filter sum they were sliced on (bitSoft[]).
+ * Returns the number of bits, at most count + 1.
+ */
+int clockRecoveryProcessBlock(struct ClockRecovery *cr, const int *decisions, const int *soft, int count, long long int sampleCount, int *bits, long long int *bitSamples, int *bitSoft){
+	int nbBits = 0;
+	for(int i = 0 ; i < count ; i++){
+		uint32_t step = cr->nominalStep + cr->stepOffset;
+		int decision = decisions[i];
+		int value = soft[i];
+		if((0 == cr->previousDecision) && (0 != decision)){
+			cr->edges = 0;
+			cr->stepOffset = 0;
+		}else if((0 != cr->previousDecision) && (0 != decision) && ((cr->previousSoft < 0) != (value < 0))){
+			// phase when the sum crosses 0, between the two samples
+			uint32_t crossing = cr->phase + (uint32_t)(((int64_t)step * cr->previousSoft) / (cr->previousSoft - value));
+			int32_t error = (int32_t)(crossing - CLOCK_RECOVERY_HALF_BIT);
+			if(0 == cr->edges++){
+				cr->phase -= error;
+			}else{
+				cr->phase -= error / 4;
+				cr->stepOffset -= error / 1024;
+				if(cr->stepOffset > cr->maxStepOffset){
+					cr->stepOffset = cr->maxStepOffset;
+				}else if(cr->stepOffset < -cr->maxStepOffset){
+					cr->stepOffset = -cr->maxStepOffset;
+				}
+			}
+		}
+		uint32_t next = cr->phase + step;
+		if(next < cr->phase){
+			// middle of a bit between the two samples
+			if((0 == cr->previousDecision) || (0 == decision)){
+				bits[nbBits] = 0;
+				bitSoft[nbBits] = 0;
+			}else{
+				uint32_t after = -cr->phase;
+				int64_t middle = (int64_t)cr->previousSoft * (step - after) + (int64_t)value * after;
+				bits[nbBits] = (middle < 0) ? -1 : +1;
+				bitSoft[nbBits] = (int)(middle / (int64_t)step);
+			}
+			bitSamples[nbBits++] = sampleCount + i;
+		}
+		cr->phase = next;
+		cr->previousSoft = value;
+		cr->previousDecision = decision;
+	}
+	return(nbBits);
+}
+
+/*
+ * Preamble correlator: the phase filter sums are correlated with the sync pattern, a piecewise
+ * constant template (the value of each of its runs), as they are demodulated. The correlation
+ * over a window is a weighted sum of the prefix sums of the input taken at the run boundaries,
+ * one tap per boundary. The sync pattern being a unit (the 0x55 byte) repeated and a tail, the
+ * unit is correlated once per sample and the repetitions are added from its past correlations
+ * (comb), along with the tail: a few tens of additions per sample whatever the sample rate.
+ * Each repetition is placed at its rounded sample, so that fractional sample per bit ratios
+ * don't drift along the pattern. The correlation is normalized by the energy of the window
+ * (and of the template): close to 100% for a noiseless preamble, around 0 for noise, and low
+ * for a window only partly within the burst.
+ * The preamble repeats itself, a window a byte or two off still correlates well: the peak is the
+ * highest (and latest) correlation until none as high is found for PREAMBLE_PEAK_WINDOW_BITS
+ * bits. It is the last sample of the sync pattern, the first byte of the frame starts right after it.
+ */
+#define PREAMBLE_PEAK_WINDOW_BITS (32)
+#define PREAMBLE_MAX_DETECTIONS (4) // per block, more are dropped
+#define PREAMBLE_METRIC_SHIFT (10)
+#define PREAMBLE_DEFAULT_THRESHOLD (60) // percent, --preamble 0 disables the correlator
+
+struct PreambleDetection {
+	int index;            // sample of the block the peak was confirmed at
+	long long int sample; // first sample after the peak
+	int metric;           // normalized correlation at the peak, in percent
+};
+
+struct PreambleTaps {
+	int count;
+	int offsets[PACKED_RUN_MAX_LENGTH + 1]; // prefix sum index, from the one before the first sample of the window
+	int weights[PACKED_RUN_MAX_LENGTH + 1]; // value of the run before the boundary minus the one after
+};
+
+struct PreambleCorrelator {
+	PackedRun unit[PACKED_RUN_MAX_LENGTH]; // sync pattern: unit repeated, then tail
+	int unitLength;
+	int repeat;           // 0 when the correlator is disabled
+	PackedRun tail[PACKED_RUN_MAX_LENGTH];
+	int tailLength;
+	int threshold;        // percent
+	int samplesPerBit;
+	int length;           // samples in the sync pattern
+	struct PreambleTaps unitTaps; // from the start of a unit
+	struct PreambleTaps tailTaps; // from the start of the window
+	int *unitEnds;        // prefix sum index of the end of each unit, from the start of the window
+	uint32_t *prefix;     // prefix sums of the phase filter sums (wrapping, only differences are used)
+	uint32_t *unitCorrelation; // correlation of the unit ending at each prefix sum
+	uint64_t *energy;     // prefix sums of the squared phase filter sums
+	int capacity;
+	int used;             // prefix sums filled, the first ones being the history of the window
+	int tracking;         // above the threshold, the peak is not confirmed yet
+	int armed;            // fell below the threshold since the last detection
+	long long int peakSample;
+	int peakScore;
+	unsigned int detections;
+};
+
+static inline int preambleBitsToSamples(int bits, unsigned int sampleRate, unsigned int bitRate){
+	return((int)(((uint64_t)bits * sampleRate + bitRate / 2) / bitRate));
+}
+
+// Boundaries of count runs starting firstBit bits after the start of the window
+static int preambleTapsInit(struct PreambleTaps *taps, const PackedRun *runs, int count, int firstBit, unsigned int sampleRate, unsigned int bitRate){
+	int previousValue = 0;
+	int bits = firstBit;
+	for(int k = 0 ; k <= count ; k++){
+		int value = (k < count) ? packedRunValue(runs[k]) : 0;
+		taps->offsets[k] = preambleBitsToSamples(bits, sampleRate, bitRate);
+		taps->weights[k] = previousValue - value;
+		if(k < count){
+			bits += packedRunLength(runs[k]);
+		}
+		previousValue = value;
+	}
+	taps->count = count + 1;
+	return(bits - firstBit);
+}
+
+// Correlation of the taps over count windows, the first one starting after windowStart[0]
+static inline void preambleTapsCorrelate(const struct PreambleTaps *taps, const uint32_t *restrict windowStart, int count, uint32_t *restrict correlation){
+	for(int k = 0 ; k < taps->count ; k++){
+		const uint32_t *tap = windowStart + taps->offsets[k];
+		uint32_t weight = (uint32_t)taps->weights[k];
+		for(int i = 0 ; i < count ; i++){
+			correlation[i] += weight * tap[i];
+		}
+	}
+}
+
+static void preambleCorrelatorClear(struct PreambleCorrelator *pc){
+	pc->used = pc->length + 1;
+	memset(pc->prefix, 0, pc->used * sizeof(uint32_t));
+	memset(pc->unitCorrelation, 0, pc->used * sizeof(uint32_t));
+	memset(pc->energy, 0, pc->used * sizeof(uint64_t));
+	pc->tracking = 0;
+	pc->armed = 1;
+}
+
+void preambleCorrelatorFree(struct PreambleCorrelator *pc){
+	free(pc->unitEnds);
+	free(pc->prefix);
+	free(pc->unitCorrelation);
+	free(pc->energy);
+	pc->unitEnds = NULL;
+	pc->prefix = NULL;
+	pc->unitCorrelation = NULL;
+	pc->energy = NULL;
+	pc->repeat = 0;
+}
+
+int preambleCorrelatorSetRates(struct PreambleCorrelator *pc, unsigned int sampleRate, unsigned int bitRate){
+	if(0 == pc->repeat){
+		return(0);
+	}
+	int unitBits = preambleTapsInit(&pc->unitTaps, pc->unit, pc->unitLength, 0, sampleRate, bitRate);
+	int tailBits = preambleTapsInit(&pc->tailTaps, pc->tail, pc->tailLength, pc->repeat * unitBits, sampleRate, bitRate);
+	pc->samplesPerBit = preambleBitsToSamples(1, sampleRate, bitRate);
+	pc->length = preambleBitsToSamples(pc->repeat * unitBits + tailBits, sampleRate, bitRate);
+	pc->capacity = pc->length + 1 + 4 * NB_SAMPLE;
+	free(pc->unitEnds);
+	free(pc->prefix);
+	free(pc->unitCorrelation);
+	free(pc->energy);
+	pc->unitEnds = (int *)calloc(pc->repeat, sizeof(int));
+	pc->prefix = (uint32_t *)calloc(pc->capacity, sizeof(uint32_t));
+	pc->unitCorrelation = (uint32_t *)calloc(pc->capacity, sizeof(uint32_t));
+	pc->energy = (uint64_t *)calloc(pc->capacity, sizeof(uint64_t));
+	if((NULL == pc->unitEnds) || (NULL == pc->prefix) || (NULL == pc->unitCorrelation) || (NULL == pc->energy)){
+		preambleCorrelatorFree(pc);
+		return(1);
+	}
+	for(int j = 0 ; j < pc->repeat ; j++){
+		pc->unitEnds[j] = preambleBitsToSamples((j + 1) * unitBits, sampleRate, bitRate);
+	}
+	preambleCorrelatorClear(pc);
+	return(0);
+}
+
+/*
+ * Correlate against the sync pattern made of the unitLength runs of unit repeated repeat times,
+ * followed by the tailLength runs of tail. Detections reach threshold percent.
+ */
+int preambleCorrelatorInit(struct PreambleCorrelator *pc, const PackedRun *unit, int unitLength, int repeat, const PackedRun *tail, int tailLength, int threshold, unsigned int sampleRate, unsigned int bitRate){
+	*pc = (struct PreambleCorrelator){ 0 };
+	if((unitLength > PACKED_RUN_MAX_LENGTH) || (tailLength > PACKED_RUN_MAX_LENGTH) || (repeat < 1)){
+		return(1);
+	}
+	memcpy(pc->unit, unit, unitLength * sizeof(PackedRun));
+	pc->unitLength = unitLength;
+	memcpy(pc->tail, tail, tailLength * sizeof(PackedRun));
+	pc->tailLength = tailLength;
+	pc->repeat = repeat;
+	pc->threshold = threshold;
+	return(preambleCorrelatorSetRates(pc, sampleRate, bitRate));
+}
+
+/*
+ * Correlate count phase filter sums, the first of them being sample firstSample.
+ * Returns the number of peaks confirmed in the block, written to detections[].
+ */
+int preambleCorrelatorProcessBlock(struct PreambleCorrelator *pc, const int *soft, int count, long long int firstSample, struct PreambleDetection *detections){
+	if(pc->used + count > pc->capacity){
+		// keep the history of the window
+		int history = pc->length + 1;
+		memmove(pc->prefix, pc->prefix + pc->used - history, history * sizeof(uint32_t));
+		memmove(pc->unitCorrelation, pc->unitCorrelation + pc->used - history, history * sizeof(uint32_t));
+		memmove(pc->energy, pc->energy + pc->used - history, history * sizeof(uint64_t));
+		pc->used = history;
+	}
+	uint32_t *prefix = pc->prefix + pc->used;
+	uint64_t *energy = pc->energy + pc->used;
+	for(int i = 0 ; i < count ; i++){
+		prefix[i] = prefix[i - 1] + (uint32_t)soft[i];
+		energy[i] = energy[i - 1] + (uint64_t)((int64_t)soft[i] * soft[i]);
+	}
+	// sample i ends the window starting after prefix sum i - length
+	uint32_t *unitCorrelation = pc->unitCorrelation + pc->used;
+	memset(unitCorrelation, 0, count * sizeof(uint32_t));
+	preambleTapsCorrelate(&pc->unitTaps, prefix - pc->unitEnds[0], count, unitCorrelation);
+	uint32_t correlation[NB_SAMPLE] = { 0 };
+	const uint32_t *windowStart = prefix - pc->length;
+	preambleTapsCorrelate(&pc->tailTaps, windowStart, count, correlation);
+	const uint32_t *unitStart = unitCorrelation - pc->length;
+	for(int j = 0 ; j < pc->repeat ; j++){
+		const uint32_t *unitEnd = unitStart + pc->unitEnds[j];
+		for(int i = 0 ; i < count ; i++){
+			correlation[i] += unitEnd[i];
+		}
+	}
+	const uint64_t *energyStart = energy - pc->length;
+	pc->used += count;
+
+	int nbDetections = 0;
+	int peakWindow = PREAMBLE_PEAK_WINDOW_BITS * pc->samplesPerBit;
+	for(int i = 0 ; i < count ; i++){
+		int32_t value = (int32_t)correlation[i];
+		long long int sample = firstSample + i + 1;
+		// value^2 / (energy * length) against threshold^2, the square root only for the peak search
+		double windowEnergy = 0.0;
+		int above = 0;
+		if(value > 0){
+			windowEnergy = (double)(energy[i] - energyStart[i]) * pc->length;
+			above = ((double)value * value * 10000.0 >= windowEnergy * pc->threshold * pc->threshold);
+		}
+		if(above && pc->armed){
+			int score = (int)(value * (double)(1 << PREAMBLE_METRIC_SHIFT) / sqrt(windowEnergy));
+			if((0 == pc->tracking) || (score >= pc->peakScore)){
+				pc->peakScore = score;
+				pc->peakSample = sample;
+			}
+			pc->tracking = 1;
+		}else if(0 == above){
+			pc->armed = 1;
+		}
+		if(pc->tracking && ((sample - pc->peakSample) >= peakWindow)){
+			if(nbDetections < PREAMBLE_MAX_DETECTIONS){
+				detections[nbDetections++] = (struct PreambleDetection){ i, pc->peakSample, (pc->peakScore * 100) >> PREAMBLE_METRIC_SHIFT};
+			}
+			pc->detections++;
+			pc->tracking = 0;
+			pc->armed = above ? 0 : 1;
+		}
+	}
+	return(nbDetections);
+}
+
+/*
+ * Runs longer than any run of a frame (the idle tail after the last byte) are reported in
+ * pieces of RLE_MAX_RUN_BITS bits, so that the frame decoder gets the stop bit of the last
+ * byte without waiting for the carrier to drop.
+ * The reliability of the first bits of the run is taken from the phase filter sum at the middle
+ * of each bit, sample bitCenters[k] of the run for bit k (or where the bit is sliced, when the
+ * clock is recovered), a bit whose middle was not reached being the least reliable.
+ */
+#define RLE_MAX_RUN_BITS (32)
+
+struct RleEncoder {
+	int previousValue;
+	int length;
+	long long int start; // first sample of the run, when the run is counted in bits
+	long long int burstStart; // first sample after the last carrier drop, origin of the packed run samples
+	uint32_t reliabilities; // of the bits of the run, see PackedRun
+	int centers; // bit middles passed in the run
+};
+
+/*
+ * Run lengths (in samples) are classified through a table, rebuilt when the rates change:
+ * sampleLengthToBitLength() of every length up to maxRunLength, the longest non-zero run
+ * the run-length encoder reports. Two bytes per length, a few KB at 2 Msps.
+ */
+struct RunClassification {
+	uint8_t bitLength;
+	uint8_t confidence;
+};
+
+/*
+ * Bit rate calibration, each transmitter crystal being slightly off: the data bits of the 0x55
+ * preamble bytes alternate, making runs of one bit. The span of BAUD_ESTIMATOR_RUNS consecutive
+ * runs of about one bit (half to one and a half bit at the current rate, whatever their
+ * confidence) is that many bits, the length bias of the +1 and -1 runs canceling out over an
+ * even count. The spans of a burst are summed, and when the burst ends its rate is averaged
+ * over the bursts: once it moved by BAUD_ESTIMATOR_UPDATE_PPM, the chain runs at it (the run
+ * classification is rebuilt), within maxDeviation of the nominal rate.
+ */
+#define BAUD_ESTIMATOR_RUNS (8) // one 0x55 byte
+#define BAUD_ESTIMATOR_MIN_BITS (64) // measured in a burst for it to count
+#define BAUD_ESTIMATOR_AVERAGE_SHIFT (2)
+#define BAUD_ESTIMATOR_UPDATE_PPM (1000)
+#define BAUD_ESTIMATOR_DEFAULT_DEVIATION (5) // percent
+
+struct BaudEstimator {
+	unsigned int nominal;  // bit rate, 0 when not calibrated
+	int maxDeviation;      // percent
+	unsigned int estimate; // averaged over the bursts
+	int runs;              // consecutive runs of about one bit
+	int span;              // their samples
+	uint64_t burstSamples; // spans of the current burst
+	unsigned int burstBits;
+};
+
+struct DemodEngine;
+
+/*
+ * Demodulation chain state, from IQ samples to runs
+ */
+struct DemodChain {
+	const struct DemodEngine *engine;
+	FMDemoder fm;
+	ToneBank tones; // tone bank engine state
+	struct RleEncoder rleEncoder;
+	unsigned int sampleRate;
+	unsigned int bitRate;
+	int maxRunLength; // samples in RLE_MAX_RUN_BITS bits
+	int bitCenters[PACKED_RUN_RELIABLE_BITS]; // run length (in samples) at the middle of each of the first bits
+	struct RunClassification *runClassification; // maxRunLength + 1 entries, NULL if it could not be allocated
+	int clockRecoveryEnabled; // runs are counted in recovered bits instead of samples
+	struct ClockRecovery clockRecovery;
+	struct PreambleCorrelator preamble; // disabled until demodChainSetPreamble()
+	struct BaudEstimator baudEstimator; // disabled until demodChainSetCalibration()
+};
+
+void demodChainSetRates(struct DemodChain *chain, unsigned int sampleRate, unsigned int bitRate){
+	chain->sampleRate = sampleRate;
+	chain->bitRate = bitRate;
+	chain->maxRunLength = (int)(((uint64_t)RLE_MAX_RUN_BITS * sampleRate + bitRate / 2) / bitRate);
+	for(int k = 0 ; k < PACKED_RUN_RELIABLE_BITS ; k++){
+		chain->bitCenters[k] = 1 + (int)(((uint64_t)(2 * k + 1) * sampleRate + bitRate) / (2 * (uint64_t)bitRate));
+	}
+	clockRecoverySetRates(&chain->clockRecovery, sampleRate, bitRate);
+	if(preambleCorrelatorSetRates(&chain->preamble, sampleRate, bitRate)){
+		fprintf(stderr, "%s: unable to allocate the preamble correlator, disabled" "\n", __func__);
+	}
+
+	free(chain->runClassification);
+	chain->runClassification = (struct RunClassification *)calloc(chain->maxRunLength + 1, sizeof(struct RunClassification));
+	if(chain->runClassification){
+		for(int length = 0 ; length <= chain->maxRunLength ; length++){
+			int confidence;
+			int bitLength = sampleLengthToBitLength(length, sampleRate, bitRate, &confidence, 4);
+			chain->runClassification[length] = (struct RunClassification){ (bitLength > UINT8_MAX) ? UINT8_MAX : bitLength, (confidence > UINT8_MAX) ? UINT8_MAX : confidence};
+		}
+	}
+}
+
+// Calibrate the bit rate, up to maxDeviation percent from the current one, 0 to keep it
+void demodChainSetCalibration(struct DemodChain *chain, int maxDeviation){
+	struct BaudEstimator *be = &chain->baudEstimator;
+	*be = (struct BaudEstimator){ 0 };
+	if((maxDeviation > 0) && (0 == chain->clockRecoveryEnabled)){
+		be->nominal = chain->bitRate;
+		be->estimate = chain->bitRate;
+		be->maxDeviation = maxDeviation;
+	}
+}
+
+// A run of length samples ended
+static inline void demodChainCalibrateRun(struct DemodChain *chain, int length){
+	struct BaudEstimator *be = &chain->baudEstimator;
+	// half a bit <= length <= one and a half bit
+	uint64_t scaled = 2 * (uint64_t)length * chain->bitRate;
+	if((scaled >= chain->sampleRate) && (scaled <= 3 * (uint64_t)chain->sampleRate)){
+		be->span += length;
+		if(BAUD_ESTIMATOR_RUNS == ++be->runs){
+			be->burstSamples += be->span;
+			be->burstBits += BAUD_ESTIMATOR_RUNS;
+			be->runs = 0;
+			be->span = 0;
+		}
+	}else{
+		be->runs = 0;
+		be->span = 0;
+	}
+}
+
+// The burst ended: average its rate, and follow it once it moved enough
+static void demodChainCalibrateBurst(struct DemodChain *chain){
+	struct BaudEstimator *be = &chain->baudEstimator;
+	if(be->burstBits >= BAUD_ESTIMATOR_MIN_BITS){
+		int64_t measured = (int64_t)(((uint64_t)chain->sampleRate * be->burstBits + be->burstSamples / 2) / be->burstSamples);
+		int64_t estimate = (int64_t)be->estimate + ((measured - (int64_t)be->estimate) >> BAUD_ESTIMATOR_AVERAGE_SHIFT);
+		int64_t maxOffset = ((int64_t)be->nominal * be->maxDeviation) / 100;
+		if(estimate < (int64_t)be->nominal - maxOffset){
+			estimate = (int64_t)be->nominal - maxOffset;
+		}else if(estimate > (int64_t)be->nominal + maxOffset){
+			estimate = (int64_t)be->nominal + maxOffset;
+		}
+		be->estimate = (unsigned int)estimate;
+		int64_t offset = estimate - (int64_t)chain->bitRate;
+		if(llabs(offset) * 1000000 >= (int64_t)chain->bitRate * BAUD_ESTIMATOR_UPDATE_PPM){
+			demodChainSetRates(chain, chain->sampleRate, be->estimate);
+		}
+	}
+	be->runs = 0;
+	be->span = 0;
+	be->burstSamples = 0;
+	be->burstBits = 0;
+}
+
+static inline int demodChainBitLength(struct DemodChain *chain, int length, int *confidence){
+	if(chain->runClassification && (length <= chain->maxRunLength)){
+		*confidence = chain->runClassification[length].confidence;
+		return(chain->runClassification[length].bitLength);
+	}
+	return(sampleLengthToBitLength(length, chain->sampleRate, chain->bitRate, confidence, 4));
+}
+
+/*
+ * Demodulator engines, from IQ samples to +1/-1/0 decisions and the soft values behind them
+ * (soft may be NULL), selected with --engine.
+ */
+struct DemodEngine {
+	const char *name;
+	void (*processBlock)(struct DemodChain *chain, iq_sample *in, int count, int *out, int *soft);
+};
+
+static void demodEngineCrossProduct(struct DemodChain *chain, iq_sample *in, int count, int *out, int *soft){
+	FMDemoderProcessBlock(&chain->fm, in, count, out, soft);
+}
+
+static void demodEngineTones(struct DemodChain *chain, iq_sample *in, int count, int *out, int *soft){
+	toneBankProcessBlock(&chain->tones, &chain->fm, in, count, out, soft);
+}
+
+static const struct DemodEngine demodEngines[] = {
+	{ "crossproduct", demodEngineCrossProduct },
+	{ "tones",        demodEngineTones },
+};
+#define DEMOD_ENGINE_COUNT (sizeof(demodEngines) / sizeof(demodEngines[0]))
+
+const struct DemodEngine *demodEngineFind(const char *name){
+	for(int i = 0 ; i < DEMOD_ENGINE_COUNT ; i++){
+		if(0 == strcmp(name, demodEngines[i].name)){
+			return(&demodEngines[i]);
+		}
+	}
+	return(NULL);
+}
+
+void demodChainInit(struct DemodChain *chain, unsigned int sampleRate, unsigned int bitRate, int clockRecoveryEnabled, const struct DemodEngine *engine){
+	chain->engine = engine;
+	FMDemoderInit(&chain->fm, sampleRate, 4, 4, 0);
+	toneBankInit(&chain->tones, sampleRate, bitRate);
+	chain->rleEncoder = (struct RleEncoder){ 0 };
+	chain->runClassification = NULL;
+	chain->preamble = (struct PreambleCorrelator){ 0 };
+	chain->baudEstimator = (struct BaudEstimator){ 0 };
+	chain->clockRecoveryEnabled = clockRecoveryEnabled;
+	clockRecoveryInit(&chain->clockRecovery, sampleRate, bitRate);
+	demodChainSetRates(chain, sampleRate, bitRate);
+}
+
+/*
+ * Correlate the demodulated signal with the sync pattern (see preambleCorrelatorInit()), sync
+ * marks being reported for the correlation peaks reaching threshold percent.
+ */
+int demodChainSetPreamble(struct DemodChain *chain, const PackedRun *unit, int unitLength, int repeat, const PackedRun *tail, int tailLength, int threshold){
+	preambleCorrelatorFree(&chain->preamble);
+	return(preambleCorrelatorInit(&chain->preamble, unit, unitLength, repeat, tail, tailLength, threshold, chain->sampleRate, chain->bitRate));
+}
+
+// Power gate marginDb above the noise floor, 0 for the fixed threshold (see NoiseFloor)
+void demodChainSetNoiseMargin(struct DemodChain *chain, int marginDb){
+	noiseFloorSetMargin(&chain->fm.noiseFloor, marginDb);
+}
+
+void demodChainFree(struct DemodChain *chain){
+	FMDemoderFree(&chain->fm);
+	preambleCorrelatorFree(&chain->preamble);
+	free(chain->runClassification);
+	chain->runClassification = NULL;
+}
+
+// The samples stop here (squelch closed): the next ones start from a carrier drop
+void demodChainCarrierLost(struct DemodChain *chain){
+	if(chain->baudEstimator.nominal){
+		demodChainCalibrateBurst(chain);
+	}
+	chain->rleEncoder.previousValue = 0;
+	chain->rleEncoder.length = 0;
+	chain->clockRecovery.previousDecision = 0;
+	if(chain->preamble.repeat){
+		preambleCorrelatorClear(&chain->preamble);
+	}
+}
+
+/*
+ * The first run of the frame starts at the sample after the correlation peak (or half a bit
+ * later, in the middle of its first bit, when the clock is recovered): the mark is set half
+ * a bit before, for the frame decoder to tell it from the runs of the sync pattern.
+ */
+static inline PackedRun demodChainSyncMark(struct DemodChain *chain, const struct PreambleDetection *detection){
+	return(packSyncMark(detection->sample - chain->preamble.samplesPerBit / 2 - chain->rleEncoder.burstStart));
+}
+
+// A new run, of length samples or bits
+static inline void rleEncoderStart(struct RleEncoder *rleEncoder, int length){
+	rleEncoder->length = length;
+	rleEncoder->reliabilities = 0;
+	rleEncoder->centers = 0;
+}
+
+// Keep the reliability of the next bit of the run, from the phase filter sum at its middle
+static inline void rleEncoderBitCenter(struct RleEncoder *rleEncoder, int soft){
+	if(rleEncoder->centers < PACKED_RUN_RELIABLE_BITS){
+		rleEncoder->reliabilities |= packedRunReliability(soft) << (4 * rleEncoder->centers++);
+	}
+}
+
+/*
+ * Run-length encode recovered bits, same output as the sample run-length encoding below
+ */
+static int demodBlockClockRecovery(struct DemodChain *chain, const int *decisions, const int *soft, int count, long long int sampleCount, const struct PreambleDetection *detections, int nbDetections, PackedRun *runs){
+	struct RleEncoder *rleEncoder = &chain->rleEncoder;
+	int nbRuns = 0;
+	int bits[NB_SAMPLE + 1];
+	long long int bitSamples[NB_SAMPLE + 1];
+	int bitSoft[NB_SAMPLE + 1];
+	int nbBits = clockRecoveryProcessBlock(&chain->clockRecovery, decisions, soft, count, sampleCount, bits, bitSamples, bitSoft);
+	int detection = 0;
+	for(int i = 0 ; i < nbBits ; i++){
+		while((detection < nbDetections) && (sampleCount + detections[detection].index <= bitSamples[i])){
+			runs[nbRuns++] = demodChainSyncMark(chain, &detections[detection++]);
+		}
+		if(rleEncoder->previousValue == bits[i]){
+			if(0 == rleEncoder->length){
+				rleEncoder->start = bitSamples[i];
+			}
+			rleEncoder->length++;
+			rleEncoderBitCenter(rleEncoder, bitSoft[i]);
+			if((0 != bits[i]) && (RLE_MAX_RUN_BITS == rleEncoder->length)){
+				runs[nbRuns++] = packReliableRun(rleEncoder->previousValue, RLE_MAX_RUN_BITS, rleEncoder->start - rleEncoder->burstStart, rleEncoder->reliabilities);
+				rleEncoderStart(rleEncoder, 0);
+			}
+		}else{
+			if((rleEncoder->previousValue != 0) && (rleEncoder->length > 0)){
+				runs[nbRuns++] = packReliableRun(rleEncoder->previousValue, rleEncoder->length, rleEncoder->start - rleEncoder->burstStart, rleEncoder->reliabilities);
+			}
+			if(0 == bits[i]){
+				runs[nbRuns++] = PACKED_RUN_CARRIER_DROP;
+			}else if(0 == rleEncoder->previousValue){
+				rleEncoder->burstStart = bitSamples[i];
+			}
+			rleEncoderStart(rleEncoder, 1);
+			rleEncoderBitCenter(rleEncoder, bitSoft[i]);
+			rleEncoder->previousValue = bits[i];
+			rleEncoder->start = bitSamples[i];
+		}
+	}
+	while(detection < nbDetections){
+		runs[nbRuns++] = demodChainSyncMark(chain, &detections[detection++]);
+	}
+	return nbRuns;
+}
+
+/*
+ * Demodulate a block of IQ samples and run-length encode the decisions.
+ * Runs are written to runs[] in the order frameDecoderUpdate() expects them,
+ * a carrier drop being reported as PACKED_RUN_CARRIER_DROP.
+ * Returns the number of runs written (at most NB_RUN for NB_SAMPLE samples).
+ */
+int demodBlock(struct DemodChain *chain, iq_sample *in, int count, PackedRun *runs){
+	FMDemoder *fm = &chain->fm;
+	struct RleEncoder *rleEncoder = &chain->rleEncoder;
+	int nbRuns = 0;
+	int decisions[NB_SAMPLE];
+	int soft[NB_SAMPLE];
+	long long int sampleCount = fm->sampleCount;
+	chain->engine->processBlock(chain, in, count, decisions, soft);
+	struct PreambleDetection detections[PREAMBLE_MAX_DETECTIONS];
+	int nbDetections = 0;
+	int detection = 0;
+	if(chain->clockRecoveryEnabled){
+		if(chain->preamble.repeat){
+			nbDetections = preambleCorrelatorProcessBlock(&chain->preamble, soft, count, sampleCount, detections);
+		}
+		return demodBlockClockRecovery(chain, decisions, soft, count, sampleCount, detections, nbDetections, runs);
+	}
+	if(chain->preamble.repeat){
+		// run samples are counted from 1 below
+		nbDetections = preambleCorrelatorProcessBlock(&chain->preamble, soft, count, sampleCount + 1, detections);
+	}
+	for(int i = 0 ; i < count; i++){
+		int demoded = decisions[i];
+		sampleCount++;
+		if((detection < nbDetections) && (detections[detection].index == i)){
+			runs[nbRuns++] = demodChainSyncMark(chain, &detections[detection++]);
+		}
+		// fprintf(stdout, "%14llu: %i -> %i" "\n", sampleCount, rleEncoder->previousValue, demoded);
+		if(rleEncoder->previousValue == demoded){
+			rleEncoder->length++;
+			if((rleEncoder->centers < PACKED_RUN_RELIABLE_BITS) && (chain->bitCenters[rleEncoder->centers] == rleEncoder->length)){
+				rleEncoderBitCenter(rleEncoder, soft[i]);
+			}
+			if((0 != demoded) && (chain->maxRunLength == rleEncoder->length)){
+				runs[nbRuns++] = packReliableRun(rleEncoder->previousValue, RLE_MAX_RUN_BITS, (sampleCount - rleEncoder->length) - rleEncoder->burstStart, rleEncoder->reliabilities);
+				rleEncoderStart(rleEncoder, 0);
+			}
+		}else{
+			if(rleEncoder->previousValue != 0){
+				if(chain->baudEstimator.nominal){
+					demodChainCalibrateRun(chain, rleEncoder->length);
+				}
+				int confidence;
+				int bitLength = demodChainBitLength(chain, rleEncoder->length, &confidence);
+				// fprintf(stdout, "%14llu: %2i -> %2i, rleEncoder.length %i bitLength %i, confidence %i%c" "\n", sampleCount, rleEncoder->previousValue, demoded, rleEncoder->length, bitLength, confidence, (confidence > 2) ? '!' : ' ');
+				if((confidence <= 2) && (bitLength > 0)){
+					runs[nbRuns++] = packReliableRun(rleEncoder->previousValue, bitLength, (sampleCount - rleEncoder->length) - rleEncoder->burstStart, rleEncoder->reliabilities);
+				}
+			}
+			if(0 == demoded){
+				runs[nbRuns++] = PACKED_RUN_CARRIER_DROP;
+				if(chain->baudEstimator.nominal){
+					demodChainCalibrateBurst(chain);
+				}
+			}else if(0 == rleEncoder->previousValue){
+				rleEncoder->burstStart = sampleCount;
+			}
+			rleEncoderStart(rleEncoder, 1);
+			rleEncoder->previousValue = demoded;
+		}
+	}
+	return nbRuns;
+}
+
+/*
+ * Squelch: a cheap energy detector on each incoming block gates the whole demod chain.
+ * Blocks wait in a pre-roll ring of SQUELCH_PREROLL_BLOCKS blocks before being demodulated
+ * (or skipped), so that when a block opens the gate the blocks just before it, holding the
+ * start of the preamble, are still demodulated. The ring holds copies of the blocks, or
+ * only references them when the caller keeps them in place (see fusedDemodThread()).
+ * The squelch sees every block first: it feeds the noise floor of the power gate with them (the
+ * blocks it skips included), and the gate opens when the mean loged power of a block reaches the
+ * floor plus the --snr margin, closing after SQUELCH_HOLDOFF_BLOCKS consecutive blocks below the
+ * floor plus half the margin. With the fixed power threshold (--snr 0), it opens when the mean
+ * squared magnitude of a block reaches openLevel, and closes below openLevel / 2.
+ */
+#define SQUELCH_PREROLL_BLOCKS (4)
+#define SQUELCH_HOLDOFF_BLOCKS (8)
+#define SQUELCH_DEFAULT_LEVEL (55) // squared magnitude, with the fixed power threshold only
+
+struct Squelch {
+	int openLevel; // 0 when there is no squelch
+	int closeLevel;
+	int open;
+	int quietBlocks;
+	int sinceOpen; // blocks received since the gate was last open
+	int demoding;  // the last block leaving the ring was demodulated
+	iq_sample blocks[SQUELCH_PREROLL_BLOCKS + 1][NB_SAMPLE]; // copies
+	iq_sample *queue[SQUELCH_PREROLL_BLOCKS + 1];
+	int lengths[SQUELCH_PREROLL_BLOCKS + 1];
+	int first;
+	int queued;
+	unsigned long long blockCount;
+	unsigned long long demodedBlockCount;
+};
+
+void squelchInit(struct Squelch *sq, int openLevel){
+	memset(sq, 0, sizeof(*sq));
+	sq->openLevel = openLevel;
+	sq->closeLevel = openLevel / 2;
+	sq->sinceOpen = SQUELCH_PREROLL_BLOCKS + 1;
+}
+
+static void squelchDetect(struct Squelch *sq, NoiseFloor *nf, const iq_sample *in, int count){
+	int energy = 0; // at most 2 * 128 * 128 * NB_SAMPLE
+	int power = 0;
+	for(int i = 0 ; i < count ; i++){
+		int centered_i = in[i].I - 128;
+		int centered_q = in[i].Q - 128;
+		unsigned int magP2 = (centered_i * centered_i) + (centered_q * centered_q);
+		energy += magP2;
+		power += logedMagnitudeP2(magP2);
+	}
+	int level = energy;
+	int openLevel = sq->openLevel * count;
+	int closeLevel = sq->closeLevel * count;
+	if(nf->margin){
+		nf->external = 1;
+		noiseFloorFeed(nf, power, count);
+		if(count > 0){
+			// Q8 loged power per sample
+			level = (int)(((long long)power << NOISE_FLOOR_SHIFT) / count);
+			openLevel = nf->floor + nf->margin;
+			closeLevel = nf->floor + (nf->margin / 2);
+		}
+	}
+	if(sq->open){
+		if(level < closeLevel){
+			if(++sq->quietBlocks > SQUELCH_HOLDOFF_BLOCKS){
+				sq->open = 0;
+			}
+		}else{
+			sq->quietBlocks = 0;
+		}
+	}else if(level >= openLevel){
+		sq->open = 1;
+		sq->quietBlocks = 0;
+	}
+	if(sq->open){
+		sq->sinceOpen = 0;
+	}else if(sq->sinceOpen <= SQUELCH_PREROLL_BLOCKS){
+		sq->sinceOpen++;
+	}
+}
+
+/*
+ * Same as demodBlock(), behind the squelch: the block pushed in is queued, and the block
+ * leaving the pre-roll ring is either demodulated, or skipped (only counted) when the gate
+ * stayed closed since it arrived. When the gate closes, a carrier drop is reported.
+ * Call it with in == NULL at the end of the stream to drain the ring, until it returns -1.
+ * In place, the block is not copied: it must stay untouched until it leaves the ring,
+ * squelchQueued() being the number of blocks still in it.
+ */
+static int squelchDemod(struct Squelch *sq, struct DemodChain *chain, iq_sample *in, int count, PackedRun *runs, int inPlace){
+	if(0 == sq->openLevel){
+		return(in ? demodBlock(chain, in, count, runs) : -1);
+	}
+	if(in){
+		squelchDetect(sq, &chain->fm.noiseFloor, in, count);
+		int slot = (sq->first + sq->queued) % (SQUELCH_PREROLL_BLOCKS + 1);
+		if(inPlace){
+			sq->queue[slot] = in;
+		}else{
+			memcpy(sq->blocks[slot], in, count * sizeof(iq_sample));
+			sq->queue[slot] = sq->blocks[slot];
+		}
+		sq->lengths[slot] = count;
+		sq->queued++;
+		sq->blockCount++;
+		if(sq->queued <= SQUELCH_PREROLL_BLOCKS){
+			return(0);
+		}
+	}else if(0 == sq->queued){
+		return(-1);
+	}
+	iq_sample *block = sq->queue[sq->first];
+	int length = sq->lengths[sq->first];
+	sq->first = (sq->first + 1) % (SQUELCH_PREROLL_BLOCKS + 1);
+	sq->queued--;
+
+	int nbRuns = 0;
+	// queued blocks arrived after this one
+	if(sq->sinceOpen <= sq->queued){
+		nbRuns = demodBlock(chain, block, length, runs);
+		sq->demoding = 1;
+		sq->demodedBlockCount++;
+	}else{
+		chain->fm.sampleCount += length;
+		if(sq->demoding){
+			runs[nbRuns++] = PACKED_RUN_CARRIER_DROP;
+			demodChainCarrierLost(chain);
+			sq->demoding = 0;
+		}
+	}
+	return(nbRuns);
+}
+
+int squelchDemodBlock(struct Squelch *sq, struct DemodChain *chain, iq_sample *in, int count, PackedRun *runs){
+	return(squelchDemod(sq, chain, in, count, runs, 0));
+}
+
+int squelchDemodBlockInPlace(struct Squelch *sq, struct DemodChain *chain, iq_sample *in, int count, PackedRun *runs){
+	return(squelchDemod(sq, chain, in, count, runs, 1));
+}
+
+static inline int squelchQueued(const struct Squelch *sq){
+	return(sq->openLevel ? sq->queued : 0);
+}
+
+void squelchReport(struct Squelch *sq, FILE *f){
+	if(sq->openLevel && sq->blockCount){
+		fprintf(f, "squelch   : %llu of %llu blocks demodulated (%.1f%%)" "\n", sq->demodedBlockCount, sq->blockCount, (100.0f * sq->demodedBlockCount) / sq->blockCount);
+	}
+}
+
+/*
+ * Input filter, same averaging filter as u8iqfilter, used when the filter runs
+ * in the same process as the demodulator (--fused)
+ */
+typedef struct {
+	unsigned int somme; // 32-bit, so that windows larger than 256 samples don't overflow
+	int logSize;
+	int size;
+	int index;
+	unsigned short *data;
+} u16filter_s;
+
+static void u16filterInit(u16filter_s *f, int logSize, unsigned short initialValue){
+	f->logSize = logSize;
+	f->size = (1 << logSize);
+	f->data = (unsigned short *)calloc(f->size, sizeof(unsigned short));
+	f->somme = initialValue * f->size;
+	for(int i = 0 ; i < f->size ; i++){
+		f->data[i] = initialValue;
+	}
+	f->index = f->size - 1;
+}
+
+static unsigned short u16filterUpdate(u16filter_s *f, unsigned short sample){
+	f->somme -= f->data[f->index];
+	f->somme += sample;
+	f->data[f->index] = sample;
+	if(0 == f->index){
+		f->index = f->size - 1;
+	}else{
+		f->index--;
+	}
+	return(f->somme >> f->logSize);
+}
+
+static void u16filterFree(u16filter_s *f){
+	free(f->data);
+}
+
+/*
+ * Single producer / single consumer ring of preallocated slots.
+ * The producer fills a slot in place and publishes it, the consumer processes
+ * it in place and releases it, so buffers are handed over without any copy.
+ * head is only written by the producer, tail only by the consumer.
+ */
+#define SPSC_RING_WAIT_NS (100000) // back-off when the ring is full or empty
+
+struct SpscRing {
+	const char *name;
+	unsigned int slotCount; // power of two
+	size_t slotSize;
+	unsigned char *slots;
+	int *lengths;
+	atomic_uint head;
+	atomic_uint tail;
+	atomic_int closed;
+	// Statistics, to find out which stage is the bottleneck
+	atomic_ullong publishCount;
+	atomic_ullong fillSum;
+	atomic_uint fillMax;
+	atomic_ullong fullWaits;  // producer had to wait for the consumer
+	atomic_ullong emptyWaits; // consumer had to wait for the producer
+};
+
+int spscRingInit(struct SpscRing *r, const char *name, unsigned int slotCount, size_t slotSize){
+	memset(r, 0, sizeof(*r));
+	r->name = name;
+	r->slotCount = slotCount;
+	r->slotSize = slotSize;
+	r->slots = (unsigned char *)calloc(slotCount, slotSize);
+	r->lengths = (int *)calloc(slotCount, sizeof(int));
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->closed, 0);
+	if((NULL == r->slots) || (NULL == r->lengths)){
+		free(r->slots);
+		free(r->lengths);
+		return(1);
+	}
+	return(0);
+}
+
+void spscRingFree(struct SpscRing *r){
+	free(r->slots);
+	free(r->lengths);
+}
+
+static void spscRingWait(void){
+	struct timespec ts = { 0, SPSC_RING_WAIT_NS };
+	nanosleep(&ts, NULL);
+}
+
+// Producer side: get the next free slot, waiting for the consumer if the ring is full
+void *spscRingAcquireWrite(struct SpscRing *r){
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	while((head - atomic_load_explicit(&r->tail, memory_order_acquire)) >= r->slotCount){
+		atomic_fetch_add_explicit(&r->fullWaits, 1, memory_order_relaxed);
+		spscRingWait();
+	}
+	return(r->slots + (head & (r->slotCount - 1)) * r->slotSize);
+}
+
+void spscRingPublish(struct SpscRing *r, int length){
+	unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	r->lengths[head & (r->slotCount - 1)] = length;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+
+	unsigned int fill = head + 1 - atomic_load_explicit(&r->tail, memory_order_relaxed);
+	atomic_fetch_add_explicit(&r->publishCount, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&r->fillSum, fill, memory_order_relaxed);
+	if(fill > atomic_load_explicit(&r->fillMax, memory_order_relaxed)){
+		atomic_store_explicit(&r->fillMax, fill, memory_order_relaxed);
+	}
+}
+
+void spscRingClose(struct SpscRing *r){
+	atomic_store_explicit(&r->closed, 1, memory_order_release);
+}
+
+/*
+ * Consumer side: get the published slot ahead slots after the oldest one (the ahead older slots
+ * being still held), NULL once the producer closed the ring and it is drained
+ */
+void *spscRingAcquireReadAhead(struct SpscRing *r, unsigned int ahead, int *length){
+	unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed) + ahead;
 	for(;;){
-		value >>= 1;
-		if(value > 0){
-			log2++;
+		if(tail != atomic_load_explicit(&r->head, memory_order_acquire)){
+			*length = r->lengths[tail & (r->slotCount - 1)];
+			return(r->slots + (tail & (r->slotCount - 1)) * r->slotSize);
+		}
+		if(atomic_load_explicit(&r->closed, memory_order_acquire)){
+			// head may have moved between the two loads
+			if(tail == atomic_load_explicit(&r->head, memory_order_acquire)){
+				return(NULL);
+			}
+		}else{
+			atomic_fetch_add_explicit(&r->emptyWaits, 1, memory_order_relaxed);
+			spscRingWait();
+		}
+	}
+}
+
+// Consumer side: get the oldest published slot, NULL once the producer closed the ring and it is drained
+void *spscRingAcquireRead(struct SpscRing *r, int *length){
+	return(spscRingAcquireReadAhead(r, 0, length));
+}
+
+void spscRingRelease(struct SpscRing *r){
+	atomic_fetch_add_explicit(&r->tail, 1, memory_order_release);
+}
+
+/*
+ * A ring that is mostly full means its consumer is the bottleneck,
+ * a ring that is mostly empty with a waiting consumer means its producer is.
+ */
+void spscRingReport(struct SpscRing *r, FILE *f){
+	unsigned long long publishCount = atomic_load_explicit(&r->publishCount, memory_order_relaxed);
+	unsigned long long fillSum = atomic_load_explicit(&r->fillSum, memory_order_relaxed);
+	unsigned int fill = atomic_load_explicit(&r->head, memory_order_relaxed) - atomic_load_explicit(&r->tail, memory_order_relaxed);
+	float average = publishCount ? (100.0f * fillSum) / ((float)publishCount * r->slotCount) : 0.0f;
+	fprintf(f, "ring %-5s: fill now %3u%% average %5.1f%% max %3u%% of %u slots, producer waits %llu, consumer waits %llu" "\n",
+		r->name,
+		(100 * fill) / r->slotCount,
+		average,
+		(100 * atomic_load_explicit(&r->fillMax, memory_order_relaxed)) / r->slotCount,
+		r->slotCount,
+		atomic_load_explicit(&r->fullWaits, memory_order_relaxed),
+		atomic_load_explicit(&r->emptyWaits, memory_order_relaxed));
+}
+
+/*
+ * Fused pipeline: read+filter, demod+RLE and frame decoding run in 3 threads
+ * of the same process, each one pinned to its own core when there are enough.
+ */
+#define FUSED_IQ_SLOTS (64)
+#define FUSED_RUN_SLOTS (16)
+
+enum FusedStage {
+	FUSED_STAGE_FILTER,
+	FUSED_STAGE_DEMOD,
+	FUSED_STAGE_FRAME,
+	FUSED_STAGE_COUNT
+};
+
+struct FusedPipeline {
+	int fd;
+	int filterLogSize;
+	struct DemodChain *chain;
+	struct Squelch *squelch;
+	struct FrameDecoder *frameDecoder;
+	struct SpscRing iqRing;
+	struct SpscRing runRing;
+	int pinning;
+	int reportPeriod;
+};
+
+static void fusedPinStage(struct FusedPipeline *p, enum FusedStage stage){
+	if(p->pinning){
+		cpu_set_t allowed;
+		if(0 == sched_getaffinity(0, sizeof(allowed), &allowed)){
+			int n = stage;
+			for(int cpu = 0 ; cpu < CPU_SETSIZE ; cpu++){
+				if(CPU_ISSET(cpu, &allowed) && (0 == n--)){
+					cpu_set_t set;
+					CPU_ZERO(&set);
+					CPU_SET(cpu, &set);
+					pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+					break;
+				}
+			}
+		}
+	}
+}
+
+static void *fusedFilterThread(void *arg){
+	struct FusedPipeline *p = (struct FusedPipeline *)arg;
+	fusedPinStage(p, FUSED_STAGE_FILTER);
+	u16filter_s iFilter;
+	u16filter_s qFilter;
+	u16filterInit(&iFilter, p->filterLogSize, 128);
+	u16filterInit(&qFilter, p->filterLogSize, 128);
+	for(;;){
+		iq_sample *block = (iq_sample *)spscRingAcquireWrite(&p->iqRing);
+		int lus = read(p->fd, block, NB_SAMPLE * sizeof(iq_sample));
+		if(lus > 0){
+			lus /= sizeof(iq_sample);
+			if(p->filterLogSize > 0){
+				for(int i = 0 ; i < lus ; i++){
+					block[i].I = u16filterUpdate(&iFilter, (unsigned short)(block[i].I));
+					block[i].Q = u16filterUpdate(&qFilter, (unsigned short)(block[i].Q));
+				}
+			}
+			spscRingPublish(&p->iqRing, lus);
 		}else{
 			break;
 		}
 	}
-	// fprintf(stdout, "bitLength=%i, log2=%i, remainder %i -> ", bitLength, log2, remainder);
-	if(bitLength > 1){
-		remainder /= bitLength;
+	spscRingClose(&p->iqRing);
+	u16filterFree(&iFilter);
+	u16filterFree(&qFilter);
+	return(NULL);
+}
+
+static void *fusedDemodThread(void *arg){
+	struct FusedPipeline *p = (struct FusedPipeline *)arg;
+	fusedPinStage(p, FUSED_STAGE_DEMOD);
+	int lus;
+	iq_sample *block;
+	int nbRuns;
+	// The squelch pre-roll references the blocks in the ring: the held slots are released once they left it
+	int held = 0;
+	while(NULL != (block = (iq_sample *)spscRingAcquireReadAhead(&p->iqRing, held, &lus))){
+		PackedRun *runs = (PackedRun *)spscRingAcquireWrite(&p->runRing);
+		nbRuns = squelchDemodBlockInPlace(p->squelch, p->chain, block, lus, runs);
+		for(held++ ; held > squelchQueued(p->squelch) ; held--){
+			spscRingRelease(&p->iqRing);
+		}
+		if(nbRuns > 0){
+			spscRingPublish(&p->runRing, nbRuns);
+		}
 	}
-	// fprintf(stdout, "%i" "\n", remainder);
-	*confidence = remainder;
-	return bitLength;
+	do{
+		PackedRun *runs = (PackedRun *)spscRingAcquireWrite(&p->runRing);
+		nbRuns = squelchDemodBlock(p->squelch, p->chain, NULL, 0, runs);
+		for( ; held > squelchQueued(p->squelch) ; held--){
+			spscRingRelease(&p->iqRing);
+		}
+		if(nbRuns > 0){
+			spscRingPublish(&p->runRing, nbRuns);
+		}
+	}while(nbRuns >= 0);
+	spscRingClose(&p->runRing);
+	return(NULL);
 }
 
-#define NB_SAMPLE (1024)
+static void fusedReport(struct FusedPipeline *p){
+	spscRingReport(&p->iqRing, stderr);
+	spscRingReport(&p->runRing, stderr);
+	squelchReport(p->squelch, stderr);
+}
+
+int fusedRun(struct FusedPipeline *p){
+	if(spscRingInit(&p->iqRing, "iq", FUSED_IQ_SLOTS, NB_SAMPLE * sizeof(iq_sample))){
+		return(1);
+	}
+	if(spscRingInit(&p->runRing, "run", FUSED_RUN_SLOTS, NB_RUN * sizeof(PackedRun))){
+		spscRingFree(&p->iqRing);
+		return(1);
+	}
+	cpu_set_t allowed;
+	p->pinning = (0 == sched_getaffinity(0, sizeof(allowed), &allowed)) && (CPU_COUNT(&allowed) >= FUSED_STAGE_COUNT);
+
+	pthread_t filterThread;
+	pthread_t demodThread;
+	pthread_create(&filterThread, NULL, fusedFilterThread, p);
+	pthread_create(&demodThread, NULL, fusedDemodThread, p);
+	fusedPinStage(p, FUSED_STAGE_FRAME);
+
+	struct timespec lastReport;
+	clock_gettime(CLOCK_MONOTONIC, &lastReport);
+	int nbRuns;
+	PackedRun *runs;
+	while(NULL != (runs = (PackedRun *)spscRingAcquireRead(&p->runRing, &nbRuns))){
+		frameDecoderProcessRuns(p->frameDecoder, runs, nbRuns);
+		spscRingRelease(&p->runRing);
+		if(p->reportPeriod > 0){
+			struct timespec now;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if((now.tv_sec - lastReport.tv_sec) >= p->reportPeriod){
+				fusedReport(p);
+				lastReport = now;
+			}
+		}
+	}
+	pthread_join(filterThread, NULL);
+	pthread_join(demodThread, NULL);
+	fusedReport(p);
+	spscRingFree(&p->iqRing);
+	spscRingFree(&p->runRing);
+	return(0);
+}
+
+// Demodulate and decode the whole stream, returns the number of samples read
+static long long int decodeStream(int fd, struct DemodChain *chain, struct Squelch *squelch, struct FrameDecoder *frameDecoder){
+	iq_sample in_sample[NB_SAMPLE];
+	PackedRun runs[NB_RUN];
+	long long int samples = 0;
+
+	for(;;){
+		int lus = read(fd, in_sample, sizeof(in_sample));
+		iq_sample *block = NULL;
+		if(lus > 0){
+			lus /= sizeof(in_sample[0]);
+			block = in_sample;
+			samples += lus;
+		}
+		// at the end of the stream, drain the squelch pre-roll ring
+		int nbRuns = squelchDemodBlock(squelch, chain, block, lus, runs);
+		if(nbRuns < 0){
+			break;
+		}
+		frameDecoderProcessRuns(frameDecoder, runs, nbRuns);
+	}
+	return(samples);
+}
 
 int main(int argc, char *argv[]){
 	const char *inputFileName = NULL;
@@ -573,6 +2555,17 @@ int main(int argc, char *argv[]){
 	int verbose = 0;
 	unsigned int sampleRate = 2048000;
 	unsigned int bitRate = 39400;
+	int fused = 0;
+	int filterLogSize = 2;
+	int reportPeriod = 0;
+	int squelchLevel = SQUELCH_DEFAULT_LEVEL;
+	int clockRecovery = 0;
+	int preambleThreshold = PREAMBLE_DEFAULT_THRESHOLD;
+	const struct DemodEngine *engine = &demodEngines[0];
+	int benchmark = 0;
+	int combineDepth = FRAME_COMBINER_DEFAULT_DEPTH;
+	int noiseMargin = NOISE_FLOOR_DEFAULT_MARGIN_DB;
+	int calibration = BAUD_ESTIMATOR_DEFAULT_DEVIATION;
 
 	while (1){
 		int option_index = 0;
@@ -581,10 +2574,21 @@ int main(int argc, char *argv[]){
 		{"outputfile",   required_argument, 0,  'o' },
 		{"rate",    required_argument, 0,  'r' },
 		{"starttime", required_argument, 0, 't' },
+		{"fused",   no_argument,       0,  'f' },
+		{"filter",  required_argument, 0,  'l' },
+		{"report",  required_argument, 0,  'R' },
+		{"squelch", required_argument, 0,  's' },
+		{"clockrecovery", no_argument, 0,  'c' },
+		{"preamble", required_argument, 0,  'p' },
+		{"engine",  required_argument, 0,  'e' },
+		{"benchmark", no_argument,     0,  'b' },
+		{"combine", required_argument, 0,  'C' },
+		{"snr",     required_argument, 0,  'n' },
+		{"calibration", required_argument, 0, 'a' },
 		{NULL,         0,                 0,  0 }
 		};
 
-		int c = getopt_long(argc, argv, "i:o:r:t:", long_options, &option_index);
+		int c = getopt_long(argc, argv, "i:o:r:t:fl:R:s:cp:e:bC:n:a:", long_options, &option_index);
 		if (c == -1)
 		break;
 
@@ -603,6 +2607,47 @@ int main(int argc, char *argv[]){
 			break;
 			case 't':
 				break;
+			case 'f':
+				fused = 1;
+			break;
+			case 'l':
+				filterLogSize = strtol(optarg, NULL, 0);
+			break;
+			case 'R':
+				reportPeriod = strtol(optarg, NULL, 0);
+			break;
+			case 's':
+				squelchLevel = strtol(optarg, NULL, 0);
+			break;
+			case 'c':
+				clockRecovery = 1;
+			break;
+			case 'p':
+				preambleThreshold = strtol(optarg, NULL, 0);
+			break;
+			case 'e':
+				engine = demodEngineFind(optarg);
+				if(NULL == engine){
+					fprintf(stderr, "%s: unknown engine %s, use", argv[0], optarg);
+					for(int i = 0 ; i < DEMOD_ENGINE_COUNT ; i++){
+						fprintf(stderr, " %s", demodEngines[i].name);
+					}
+					fputc('\n', stderr);
+					exit(1);
+				}
+			break;
+			case 'b':
+				benchmark = 1;
+			break;
+			case 'C':
+				combineDepth = strtol(optarg, NULL, 0);
+			break;
+			case 'n':
+				noiseMargin = strtol(optarg, NULL, 0);
+			break;
+			case 'a':
+				calibration = strtol(optarg, NULL, 0);
+			break;
 			default:
 				break;
 		}
@@ -610,8 +2655,16 @@ int main(int argc, char *argv[]){
 
 	int fd = -1;
 
-	FMDemoder fm;
-	FMDemoderInit(&fm, sampleRate, 4, 4, 0);
+	if(sampleRate < (CLOCK_RECOVERY_MAX_SAMPLE_PER_BIT * bitRate)){
+		clockRecovery = 1;
+	}
+	static struct DemodChain chain;
+	demodChainInit(&chain, sampleRate, bitRate, clockRecovery, engine);
+	demodChainSetNoiseMargin(&chain, noiseMargin);
+	demodChainSetCalibration(&chain, calibration);
+
+	static struct Squelch squelch;
+	squelchInit(&squelch, squelchLevel);
 
 	if(inputFileName){
 		if(strcmp(inputFileName, "-")){
@@ -625,60 +2678,79 @@ int main(int argc, char *argv[]){
 		exit(1);
 	}
 
-	LUTInit();
-	iq_sample in_sample[NB_SAMPLE];
-
-	struct RleEncoder{
-		int previousValue;
-		int length;
-	} rleEncoder = { 0, 0};
 
-	struct FrameDecoder *frameDecoder = frameDecoderAlloc(256, 4096);
+	struct FrameDecoder *frameDecoder = frameDecoderAlloc(256);
 
 	// Build sync pattern
 	// Capture suggest up-to 10 0x55 bytes, but worst case scenario is we can decode only 8 because of power ramp
-	for(int i = 0 ; i < 8 ; i++){
-		frameDecoderAddSyncBit(frameDecoder, +1, 3);
-		for(int j = 0 ; j < 4 ; j++){
-			frameDecoderAddSyncBit(frameDecoder, -1, 1);
-			frameDecoderAddSyncBit(frameDecoder, +1, 1);
+	// 0x55 byte with its stop bits
+	PackedRun syncUnit[16];
+	int syncUnitLength = 0;
+	syncUnit[syncUnitLength++] = packRun(+1, 3, 0);
+	for(int j = 0 ; j < 4 ; j++){
+		syncUnit[syncUnitLength++] = packRun(-1, 1, 0);
+		syncUnit[syncUnitLength++] = packRun(+1, 1, 0);
+	}
+	syncUnit[syncUnitLength++] = packRun(-1, 2, 0);
+	const int syncRepeat = 8;
+	const PackedRun syncTail[] = { packRun(+1, 16, 0) };
+	for(int i = 0 ; i < syncRepeat ; i++){
+		for(int j = 0 ; j < syncUnitLength ; j++){
+			frameDecoderAddSyncBit(frameDecoder, packedRunValue(syncUnit[j]), packedRunLength(syncUnit[j]));
 		}
-		frameDecoderAddSyncBit(frameDecoder, -1, 2);
 	}
-	frameDecoderAddSyncBit(frameDecoder, +1, 16);
+	frameDecoderAddSyncBit(frameDecoder, packedRunValue(syncTail[0]), packedRunLength(syncTail[0]));
 	// frameDecoderDumpSyncPattern(frameDecoder);
+	frameDecoderSetCombineDepth(frameDecoder, combineDepth);
+	if((preambleThreshold > 0) && demodChainSetPreamble(&chain, syncUnit, syncUnitLength, syncRepeat, syncTail, 1, preambleThreshold)){
+		fprintf(stderr, "%s: unable to allocate the preamble correlator, disabled" "\n", argv[0]);
+	}
 
-	for(;;){
-		int lus = read(fd, in_sample, sizeof(in_sample));
-		if(lus > 0){
-			lus /= sizeof(in_sample[0]);
-			for(int i = 0 ; i < lus; i++){
-				int demoded = FMDemoderUpdate(&fm, in_sample + i, 1);
-				// fprintf(stdout, "%14llu: %i -> %i" "\n", fm.sampleCount, rleEncoder.previousValue, demoded);
-				if(rleEncoder.previousValue == demoded){
-					rleEncoder.length++;
-				}else{
-					int confidence;
-					int bitLength = sampleLengthToBitLength(rleEncoder.length, sampleRate, bitRate, &confidence, 4);
-					// fprintf(stdout, "%14llu: %2i -> %2i, rleEncoder.length %i bitLength %i, confidence %i%c" "\n", fm.sampleCount, rleEncoder.previousValue, demoded, rleEncoder.length, bitLength, confidence, (confidence > 2) ? '!' : ' ');
-					if((rleEncoder.previousValue != 0) && (confidence <= 2) && (bitLength > 0)){
-						frameDecoderUpdate(frameDecoder, rleEncoder.previousValue, bitLength, (fm.sampleCount - rleEncoder.length));
-					}
-					if(0 == demoded){
-						// fprintf(stdout, "%14llu: ", fm.sampleCount);
-						frameDecoderUpdate(frameDecoder, 0, 0, 0);
-					}
-					rleEncoder.length = 1;
-					rleEncoder.previousValue = demoded;
-				}
+	if(fused){
+		struct FusedPipeline pipeline = {
+			.fd = fd,
+			.filterLogSize = filterLogSize,
+			.chain = &chain,
+			.squelch = &squelch,
+			.frameDecoder = frameDecoder,
+			.reportPeriod = reportPeriod
+		};
+		if(fusedRun(&pipeline)){
+			fprintf(stderr, "%s: unable to allocate the fused pipeline" "\n", argv[0]);
+			exit(1);
+		}
+	}else if(benchmark){
+		// every engine on the same input, which has to be a file, frames are counted only
+		frameDecoder->silent = 1;
+		for(int e = 0 ; e < DEMOD_ENGINE_COUNT ; e++){
+			if(lseek(fd, 0, SEEK_SET) < 0){
+				perror(inputFileName);
+				exit(1);
 			}
-		}else{
-			break;
+			demodChainFree(&chain);
+			demodChainInit(&chain, sampleRate, bitRate, clockRecovery, &demodEngines[e]);
+			demodChainSetNoiseMargin(&chain, noiseMargin);
+			demodChainSetCalibration(&chain, calibration);
+			if(preambleThreshold > 0){
+				demodChainSetPreamble(&chain, syncUnit, syncUnitLength, syncRepeat, syncTail, 1, preambleThreshold);
+			}
+			squelchInit(&squelch, squelchLevel);
+			frameDecoderReset(frameDecoder);
+			frameDecoderSetCombineDepth(frameDecoder, combineDepth);
+			frameDecoder->frames = 0;
+			struct timespec start, end;
+			clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+			long long int samples = decodeStream(fd, &chain, &squelch, frameDecoder);
+			clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &end);
+			double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+			fprintf(stderr, "%-12s: %6.1f ns per sample, %u frames, %.1f frames per CPU second" "\n", demodEngines[e].name,
+				(samples > 0) ? (seconds * 1e9) / samples : 0.0, frameDecoder->frames, (seconds > 0.0) ? frameDecoder->frames / seconds : 0.0);
 		}
-
+	}else{
+		decodeStream(fd, &chain, &squelch, frameDecoder);
 	}
-	FMDemoderFree(&fm);
+	frameDecoderFree(frameDecoder);
+	demodChainFree(&chain);
 	close(fd);
 	return(0);
 }
-
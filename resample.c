@@ -1,29 +1,237 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <getopt.h>
+
+#define BLOCK_SIZE (32768) // input samples per read()
+#define ZERO_CROSSINGS (6) // sinc lobes on each side of the filter center
+#define TAP_SHIFT (15)     // taps are Q15, each phase sums to exactly 1 << TAP_SHIFT
 
 typedef struct {
 	unsigned char I;
 	unsigned char Q;
 }iq_sample_s;
 
-int main(int argc, char *argv[]){
-	if(argc > 1){
-		int n = atoi(argv[1]);
-		if(n > 1){
-			iq_sample_s sample;
-			int skip = n - 1;
-			while(fread(&sample, sizeof(sample), 1, stdin)){
-				if(0 == skip){
-					fwrite(&sample, sizeof(sample), 1, stdout);
-					skip = (n - 1);
-				}else{
-					skip--;
-				}
+/*
+ * Polyphase rational resampler: upsample by L, low pass filter, downsample by M,
+ * without computing the zero-stuffed or dropped samples.
+ * Output n is computed from the input samples ending at floor(n * M / L) with
+ * phase (n * M) % L of the filter. Taps of each phase are stored reversed and
+ * samples are kept planar (centered int16), so that every output is two
+ * contiguous dot products the compiler can vectorize.
+ */
+typedef struct {
+	int up;
+	int down;
+	int taps;       // per phase, multiple of 8
+	int16_t *bank;  // up phases of taps coefficients
+	int16_t *I;     // taps - 1 samples of history followed by the current block
+	int16_t *Q;
+	int phase;      // phase of the next output
+	int index;      // index in I/Q of the last input sample of the next output
+} resampler_s;
+
+static int gcd(int a, int b){
+	while(b){
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return(a);
+}
+
+static int resamplerInit(resampler_s *r, int up, int down, int taps){
+	int g = gcd(up, down);
+	up /= g;
+	down /= g;
+	int widest = (up > down) ? up : down;
+	if(taps <= 0){
+		taps = (2 * ZERO_CROSSINGS * widest + up - 1) / up;
+	}
+	taps = (taps + 7) & ~7;
+	r->up = up;
+	r->down = down;
+	r->taps = taps;
+	r->bank = (int16_t *)calloc(up * taps, sizeof(int16_t));
+	r->I = (int16_t *)calloc(taps - 1 + BLOCK_SIZE, sizeof(int16_t));
+	r->Q = (int16_t *)calloc(taps - 1 + BLOCK_SIZE, sizeof(int16_t));
+	if((NULL == r->bank) || (NULL == r->I) || (NULL == r->Q)){
+		return(1);
+	}
+
+	// Blackman windowed sinc, cut at 90% of the lowest of the two Nyquist frequencies
+	int length = up * taps;
+	double center = (double)(length - 1) / 2.0;
+	double cutoff = 0.9 / (2.0 * widest);
+	double *prototype = (double *)calloc(length, sizeof(double));
+	if(NULL == prototype){
+		return(1);
+	}
+	for(int k = 0 ; k < length ; k++){
+		double t = (double)k - center;
+		double sinc = (0.0 == t) ? 2.0 * cutoff : sin(2.0 * M_PI * cutoff * t) / (M_PI * t);
+		double window = 0.42 - 0.5 * cos(2.0 * M_PI * (k + 0.5) / length) + 0.08 * cos(4.0 * M_PI * (k + 0.5) / length);
+		prototype[k] = sinc * window;
+	}
+	// Quantize each phase so that it sums to exactly 1.0: no DC ripple between phases
+	for(int p = 0 ; p < up ; p++){
+		double sum = 0.0;
+		for(int j = 0 ; j < taps ; j++){
+			sum += prototype[j * up + p];
+		}
+		int16_t *phase = r->bank + p * taps;
+		int total = 0;
+		int largest = 0;
+		for(int j = 0 ; j < taps ; j++){
+			// reversed: phase[taps - 1] applies to the newest sample
+			int tap = (int)lrint(prototype[j * up + p] * (1 << TAP_SHIFT) / sum);
+			phase[taps - 1 - j] = tap;
+			total += tap;
+			if(abs(tap) > abs(phase[largest])){
+				largest = taps - 1 - j;
 			}
 		}
-	}else{
-		fprintf(stderr, "Usage %s <resample factor>" "\n", argv[0]);
+		phase[largest] += (1 << TAP_SHIFT) - total;
 	}
+	free(prototype);
+
+	r->phase = 0;
+	r->index = taps - 1;
+	return(0);
+}
+
+static void resamplerFree(resampler_s *r){
+	free(r->bank);
+	free(r->I);
+	free(r->Q);
 }
 
+static inline int dotProduct(const int16_t *restrict taps, const int16_t *restrict x, int length){
+	int acc = 0;
+	for(int j = 0 ; j < length ; j++){
+		acc += taps[j] * x[j];
+	}
+	return(acc);
+}
 
+static inline unsigned char resamplerToUChar(int acc){
+	int value = 128 + ((acc + (1 << (TAP_SHIFT - 1))) >> TAP_SHIFT);
+	if(value < 0){
+		value = 0;
+	}else if(value > 255){
+		value = 255;
+	}
+	return((unsigned char)value);
+}
+
+/*
+ * Resample count input samples, returns the number of output samples written in out,
+ * at most (count * up) / down + 1.
+ */
+static int resamplerBlock(resampler_s *r, const iq_sample_s *in, int count, iq_sample_s *out){
+	int history = r->taps - 1;
+	for(int i = 0 ; i < count ; i++){
+		r->I[history + i] = (int16_t)in[i].I - 128;
+		r->Q[history + i] = (int16_t)in[i].Q - 128;
+	}
+	int end = history + count;
+	int produced = 0;
+	while(r->index < end){
+		const int16_t *taps = r->bank + r->phase * r->taps;
+		int first = r->index - history;
+		out[produced].I = resamplerToUChar(dotProduct(taps, r->I + first, r->taps));
+		out[produced].Q = resamplerToUChar(dotProduct(taps, r->Q + first, r->taps));
+		produced++;
+		r->phase += r->down;
+		r->index += r->phase / r->up;
+		r->phase %= r->up;
+	}
+	// Keep the last taps - 1 samples as history of the next block
+	memmove(r->I, r->I + count, history * sizeof(int16_t));
+	memmove(r->Q, r->Q + count, history * sizeof(int16_t));
+	r->index -= count;
+	return(produced);
+}
+
+static void usage(const char *name){
+	fprintf(stderr, "Usage %s [--taps <taps per phase>] <resample factor> | <up>/<down>" "\n", name);
+}
+
+int main(int argc, char *argv[]){
+	int taps = 0;
+
+	while (1){
+		int option_index = 0;
+		static struct option long_options[] = {
+		{"taps",    required_argument, 0,  't' },
+		{NULL,         0,                 0,  0 }
+		};
+
+		int c = getopt_long(argc, argv, "t:", long_options, &option_index);
+		if (c == -1)
+		break;
+
+		switch (c) {
+			case 't':
+				taps = strtol(optarg, NULL, 0);
+			break;
+			default:
+				usage(argv[0]);
+				exit(1);
+			break;
+		}
+	}
+	if(optind >= argc){
+		usage(argv[0]);
+		exit(1);
+	}
+	char *end;
+	int up = 1;
+	int down = strtol(argv[optind], &end, 0);
+	if('/' == *end){
+		up = down;
+		down = strtol(end + 1, NULL, 0);
+	}
+	if((up < 1) || (down < 1)){
+		usage(argv[0]);
+		exit(1);
+	}
+
+	resampler_s r;
+	if(resamplerInit(&r, up, down, taps)){
+		perror(argv[0]);
+		exit(1);
+	}
+	// fprintf(stderr, "%d/%d, %d taps per phase" "\n", r.up, r.down, r.taps);
+
+	static iq_sample_s input[BLOCK_SIZE];
+	iq_sample_s *output = (iq_sample_s *)calloc(((size_t)BLOCK_SIZE * r.up) / r.down + 1, sizeof(iq_sample_s));
+	if(NULL == output){
+		perror(argv[0]);
+		exit(1);
+	}
+	int pending = 0; // odd byte left from the previous read
+	for(;;){
+		int byteRead = read(STDIN_FILENO, (unsigned char *)input + pending, sizeof(input) - pending);
+		if(byteRead > 0){
+			int available = pending + byteRead;
+			int count = available / sizeof(iq_sample_s);
+			int produced = resamplerBlock(&r, input, count, output);
+			if((produced > 0) && (write(STDOUT_FILENO, output, produced * sizeof(iq_sample_s)) < 0)){
+				break;
+			}
+			pending = available - (count * sizeof(iq_sample_s));
+			if(pending){
+				((unsigned char *)input)[0] = ((unsigned char *)input)[available - 1];
+			}
+		}else{
+			break;
+		}
+	}
+	free(output);
+	resamplerFree(&r);
+	return(0);
+}
@@ -0,0 +1,83 @@
+/*
+ * Frame combiner of demod3: the score changes between bursts, a damaged burst of the new
+ * score must not be output as the old one.
+ * Built with demod3.c included, its main() renamed.
+ */
+#define main demod3Main
+#include "../demod3.c"
+#undef main
+
+#define SCORE_LENGTH (58)
+
+static void scoreFrame(unsigned char *frame, unsigned char digit){
+	frame[0] = 0x8F;
+	frame[1] = 0xA5;
+	for(int i = 2 ; i < SCORE_LENGTH - 1 ; i++){
+		frame[i] = 0x55;
+	}
+	frame[3] = digit;
+	frame[7] = digit;
+	frame[SCORE_LENGTH - 1] = 0xF1;
+}
+
+// Decode a burst of frame, byte erased lost to a framing error (-1 for none)
+static void burst(struct FrameDecoder *decoder, const unsigned char *frame, int erased){
+	memcpy(decoder->frame, frame, SCORE_LENGTH);
+	memset(decoder->erased, 0, sizeof(decoder->erased));
+	decoder->frameLength = SCORE_LENGTH;
+	decoder->erasures = 0;
+	if(erased >= 0){
+		decoder->frame[erased] = 0;
+		decoder->erased[erased] = 1;
+		decoder->erasures = 1;
+	}
+	frameCombine(decoder, 1);
+}
+
+static int failures = 0;
+
+static void check(int condition, const char *what){
+	if(0 == condition){
+		fprintf(stderr, "FAILED: %s" "\n", what);
+		failures++;
+	}
+}
+
+int main(int argc, char *argv[]){
+	struct FrameDecoder *decoder = frameDecoderAlloc(256);
+	if(NULL == decoder){
+		return(1);
+	}
+	decoder->silent = 1;
+	frameDecoderSetCombineDepth(decoder, 3);
+	unsigned char p0[SCORE_LENGTH];
+	unsigned char p1[SCORE_LENGTH];
+	scoreFrame(p0, 0x66);
+	scoreFrame(p1, 0x9A);
+
+	burst(decoder, p0, -1);
+	burst(decoder, p0, -1);
+	burst(decoder, p0, 10);
+	check(1 == decoder->frames, "damaged burst combined with the bursts of the same score");
+
+	decoder->frames = 0;
+	burst(decoder, p1, 14);
+	check(0 == decoder->frames, "damaged burst of a new score output as the old score");
+
+	burst(decoder, p1, -1);
+	burst(decoder, p1, 12);
+	check(0 == decoder->frames, "new score decided by a single clean burst");
+
+	burst(decoder, p1, -1);
+	burst(decoder, p1, 20);
+	check(1 == decoder->frames, "damaged burst of the new score not combined");
+	unsigned char combined[GRUNENWALD_MAX_FRAME_BYTES];
+	check((0 == frameCombinerVote(&decoder->combiners[0], SCORE_LENGTH, combined)) && (0 == memcmp(combined, p1, SCORE_LENGTH)), "new score not voted");
+
+	frameDecoderFree(decoder);
+	if(failures){
+		return(1);
+	}
+	fprintf(stderr, "frameCombine: ok" "\n");
+	return(0);
+}
@@ -1,76 +1,592 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
+#include <math.h>
+#include <getopt.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define BLOCK_SIZE (1024)
+#define FILTER_MAX_LOG_SIZE (16)
+#define FILTER_LINE_BLOCKS (16) // blocks read before the history is moved back to the start of the delay line
+#define CIC_MAX_STAGES (6)
+#define CIC_DEFAULT_STAGES (3)
+#define IQCORRECT_WINDOW (65536) // samples, time constant of the DC offset and I/Q imbalance estimates
+#define IQCORRECT_FRACTION (4)   // fraction bits of the filtered samples the correction is applied to
+#define IQCORRECT_SHIFT (13)     // coefficients are Q13
 
 typedef struct {
 	unsigned char I;
 	unsigned char Q;
 } u8iq_sample_s;
 
+/*
+ * DC offset and I/Q imbalance correction, run by the filters in their pass over each block.
+ * The filters accumulate the moments of the input samples (centered on 128) and correct
+ * their outputs with the coefficients estimated from the previous blocks:
+ *   I' = I - DC(I)
+ *   Q' = gain * ((Q - DC(Q)) - cross * I')
+ * cross = E[IQ] / E[I^2] removes the phase error, gain = sqrt(E[I^2] / E[Q'^2]) the gain error.
+ * Per sample work is integer only: outputs are taken with IQCORRECT_FRACTION bits of fraction,
+ * the coefficients being refreshed once per block.
+ */
+typedef struct {
+	// moments of the current block
+	int64_t sumI;
+	int64_t sumQ;
+	int64_t sumII;
+	int64_t sumQQ;
+	int64_t sumIQ;
+	int count;
+	// estimates averaged over IQCORRECT_WINDOW samples
+	int initialized;
+	double meanI;
+	double meanQ;
+	double powerI;
+	double powerQ;
+	double powerIQ;
+	// correction of the next block
+	int offsetI;   // 128 + DC, IQCORRECT_FRACTION bits of fraction
+	int offsetQ;
+	int gain;      // Q13
+	int crossGain; // -gain * cross, Q13
+} u8iqcorrect_s;
+
+static void u8iqcorrectInit(u8iqcorrect_s *c){
+	memset(c, 0, sizeof(*c));
+	c->offsetI = c->offsetQ = 128 << IQCORRECT_FRACTION;
+	c->gain = 1 << IQCORRECT_SHIFT;
+}
+
+static inline void u8iqcorrectAccumulate(u8iqcorrect_s *c, int I, int Q){
+	I -= 128;
+	Q -= 128;
+	c->sumI += I;
+	c->sumQ += Q;
+	c->sumII += I * I;
+	c->sumQQ += Q * Q;
+	c->sumIQ += I * Q;
+	c->count++;
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+// Add lanes alternating I and Q as accumulated by the SIMD kernels (cross holds I*Q in both lanes of a sample)
+static void u8iqcorrectAccumulateLanes(u8iqcorrect_s *c, const int32_t *sum, const int32_t *power, const int32_t *cross, int lanes, int count){
+	for(int l = 0 ; l < lanes ; l += 2){
+		c->sumI += sum[l];
+		c->sumQ += sum[l + 1];
+		c->sumII += power[l];
+		c->sumQQ += power[l + 1];
+		c->sumIQ += cross[l];
+	}
+	c->count += count;
+}
+#endif
+
+// Fold the moments of the block into the estimates and compute the correction of the next block
+static void u8iqcorrectUpdate(u8iqcorrect_s *c){
+	if(0 == c->count){
+		return;
+	}
+	double n = c->count;
+	double meanI = c->sumI / n;
+	double meanQ = c->sumQ / n;
+	double alpha = c->initialized ? (n / IQCORRECT_WINDOW) : 1.0;
+	if(alpha > 1.0){
+		alpha = 1.0;
+	}
+	c->meanI += alpha * (meanI - c->meanI);
+	c->meanQ += alpha * (meanQ - c->meanQ);
+	c->powerI += alpha * ((c->sumII / n) - (meanI * meanI) - c->powerI);
+	c->powerQ += alpha * ((c->sumQQ / n) - (meanQ * meanQ) - c->powerQ);
+	c->powerIQ += alpha * ((c->sumIQ / n) - (meanI * meanQ) - c->powerIQ);
+	c->initialized = 1;
+	c->sumI = c->sumQ = c->sumII = c->sumQQ = c->sumIQ = 0;
+	c->count = 0;
+
+	c->offsetI = (int)lrint((128.0 + c->meanI) * (1 << IQCORRECT_FRACTION));
+	c->offsetQ = (int)lrint((128.0 + c->meanQ) * (1 << IQCORRECT_FRACTION));
+	if(c->powerI <= 0.0){
+		return;
+	}
+	double cross = c->powerIQ / c->powerI;
+	if(cross > 0.5){
+		cross = 0.5;
+	}else if(cross < -0.5){
+		cross = -0.5;
+	}
+	double residual = c->powerQ - (cross * c->powerIQ);
+	double gain = (residual > 0.0) ? sqrt(c->powerI / residual) : 1.0;
+	if(gain > 2.0){
+		gain = 2.0;
+	}else if(gain < 0.5){
+		gain = 0.5;
+	}
+	c->gain = (int)lrint(gain * (1 << IQCORRECT_SHIFT));
+	c->crossGain = (int)lrint(-gain * cross * (1 << IQCORRECT_SHIFT));
+}
+
+// Rounding and the 128 center, once the correction left IQCORRECT_SHIFT + IQCORRECT_FRACTION bits of fraction
+#define IQCORRECT_BIAS ((128 << (IQCORRECT_SHIFT + IQCORRECT_FRACTION)) + (1 << (IQCORRECT_SHIFT + IQCORRECT_FRACTION - 1)))
+
+static inline unsigned char u8iqcorrectToUChar(int value){
+	value = (value + IQCORRECT_BIAS) >> (IQCORRECT_SHIFT + IQCORRECT_FRACTION);
+	if(value < 0){
+		value = 0;
+	}else if(value > 255){
+		value = 255;
+	}
+	return((unsigned char)value);
+}
+
+// I and Q are filtered samples with IQCORRECT_FRACTION bits of fraction
+static inline void u8iqcorrectSample(const u8iqcorrect_s *c, int I, int Q, unsigned char *out){
+	I -= c->offsetI;
+	Q -= c->offsetQ;
+	out[0] = u8iqcorrectToUChar(I * (1 << IQCORRECT_SHIFT));
+	out[1] = u8iqcorrectToUChar((Q * c->gain) + (I * c->crossGain));
+}
+
+/*
+ * Moving average over (1 << logSize) IQ samples, I and Q being filtered in the same pass.
+ * Samples are read directly into a delay line holding the last size input samples
+ * followed by the new block, so that the sample leaving the window is always
+ * at a fixed distance behind the one entering it.
+ * Running sums are 32-bit wide: no overflow whatever the window size.
+ */
 typedef struct {
-	unsigned short somme;
 	int logSize;
 	int size;
-	int index;
-	unsigned short *data;
-} u16filter_s;
+	uint32_t sumI;
+	uint32_t sumQ;
+	unsigned char *line;
+	int lineLength; // in bytes
+	int start;      // first byte of the history in line
+	int pending;    // odd byte left from the previous read, not filtered yet
+	u8iqcorrect_s *correct; // NULL when the samples are not corrected
+} u8iqfilter_s;
 
-static void u16filterInit(u16filter_s *f, int logSize, unsigned short initialValue){
+static int u8iqfilterInit(u8iqfilter_s *f, int logSize, unsigned char initialValue){
 	f->logSize = logSize;
 	f->size = (1 << logSize);
-	f->data = (unsigned short *)calloc(f->size, sizeof(unsigned short));
-	f->somme = initialValue * f->size;
-	for(int i = 0 ; i < f->size ; i++){
-		f->data[i] = initialValue;
+	f->lineLength = (2 * f->size) + (FILTER_LINE_BLOCKS * BLOCK_SIZE * sizeof(u8iq_sample_s));
+	f->line = (unsigned char *)malloc(f->lineLength);
+	if(NULL == f->line){
+		return(1);
 	}
-	f->index = f->size - 1;
+	memset(f->line, initialValue, 2 * f->size);
+	f->sumI = f->sumQ = initialValue * f->size;
+	f->start = 0;
+	f->pending = 0;
+	f->correct = NULL;
+	return(0);
 }
 
-static unsigned short u16filterUpdate(u16filter_s *f, unsigned short sample){
-	f->somme -= f->data[f->index];
-	f->somme += sample;
-	f->data[f->index] = sample;
-	if(0 == f->index){
-		f->index = f->size - 1;
-	}else{
-		f->index--;
+static void u8iqfilterFree(u8iqfilter_s *f){
+	free(f->line);
+}
+
+// Where the next read() should store its bytes, room for at least BLOCK_SIZE samples
+static unsigned char *u8iqfilterInput(u8iqfilter_s *f){
+	int history = 2 * f->size;
+	if((f->start + history + f->pending + (int)(BLOCK_SIZE * sizeof(u8iq_sample_s))) > f->lineLength){
+		memmove(f->line, f->line + f->start, history + f->pending);
+		f->start = 0;
+	}
+	return(f->line + f->start + history + f->pending);
+}
+
+/*
+ * x points to interleaved IQ bytes, x[-delay] being the byte leaving the window
+ * when x[0] enters it. length is an even number of bytes.
+ */
+static void u8iqfilterKernelScalar(u8iqfilter_s *f, const unsigned char *x, int length, int delay, unsigned char *out){
+	uint32_t sumI = f->sumI;
+	uint32_t sumQ = f->sumQ;
+	u8iqcorrect_s *c = f->correct;
+	for(int k = 0 ; k < length ; k += 2){
+		sumI += x[k] - x[k - delay];
+		sumQ += x[k + 1] - x[k + 1 - delay];
+		if(c){
+			u8iqcorrectAccumulate(c, x[k], x[k + 1]);
+			u8iqcorrectSample(c, (sumI << IQCORRECT_FRACTION) >> f->logSize, (sumQ << IQCORRECT_FRACTION) >> f->logSize, out + k);
+		}else{
+			out[k] = sumI >> f->logSize;
+			out[k + 1] = sumQ >> f->logSize;
+		}
 	}
-	return(f->somme >> f->logSize);
+	f->sumI = sumI;
+	f->sumQ = sumQ;
+}
+
+#if defined(__AVX2__)
+/*
+ * 8 samples per iteration, lanes are I0 Q0 I1 Q1 I2 Q2 I3 Q3.
+ * The differences (entering - leaving) are prefix-summed inside each register
+ * then offset by the running sums of the previous samples.
+ */
+static inline __m256i u8iqPrefix4(__m256i v){
+	v = _mm256_add_epi32(v, _mm256_slli_si256(v, 8));
+	__m256i low = _mm256_permute2x128_si256(v, v, 0x08);
+	return(_mm256_add_epi32(v, _mm256_shuffle_epi32(low, _MM_SHUFFLE(3, 2, 3, 2))));
+}
+
+/*
+ * DC and imbalance correction of the running sums s, in the lanes of the samples:
+ * I lanes are multiplied by 1, Q lanes by gain and added crossGain times the I lane.
+ */
+static inline __m256i u8iqCorrect8(__m256i s, __m128i shift, __m256i offset, __m256i gain, __m256i crossGain){
+	__m256i v = _mm256_sub_epi32(_mm256_srl_epi32(_mm256_slli_epi32(s, IQCORRECT_FRACTION), shift), offset);
+	__m256i r = _mm256_add_epi32(_mm256_mullo_epi32(v, gain), _mm256_mullo_epi32(_mm256_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)), crossGain));
+	return(_mm256_srai_epi32(_mm256_add_epi32(r, _mm256_set1_epi32(IQCORRECT_BIAS)), IQCORRECT_SHIFT + IQCORRECT_FRACTION));
+}
+
+static int u8iqfilterKernel(u8iqfilter_s *f, const unsigned char *x, int length, int delay, unsigned char *out){
+	const __m256i lastSample = _mm256_set_epi32(7, 6, 7, 6, 7, 6, 7, 6);
+	const __m128i shift = _mm_cvtsi32_si128(f->logSize);
+	__m256i carry = _mm256_set_epi32(f->sumQ, f->sumI, f->sumQ, f->sumI, f->sumQ, f->sumI, f->sumQ, f->sumI);
+	u8iqcorrect_s *c = f->correct;
+	const __m256i center = _mm256_set1_epi32(128);
+	__m256i offset = _mm256_setzero_si256();
+	__m256i gain = _mm256_setzero_si256();
+	__m256i crossGain = _mm256_setzero_si256();
+	// Moments per lane, at most BLOCK_SIZE samples: no overflow
+	__m256i sum = _mm256_setzero_si256();
+	__m256i power = _mm256_setzero_si256();
+	__m256i cross = _mm256_setzero_si256();
+	if(c){
+		offset = _mm256_set_epi32(c->offsetQ, c->offsetI, c->offsetQ, c->offsetI, c->offsetQ, c->offsetI, c->offsetQ, c->offsetI);
+		gain = _mm256_set_epi32(c->gain, 1 << IQCORRECT_SHIFT, c->gain, 1 << IQCORRECT_SHIFT, c->gain, 1 << IQCORRECT_SHIFT, c->gain, 1 << IQCORRECT_SHIFT);
+		crossGain = _mm256_set_epi32(c->crossGain, 0, c->crossGain, 0, c->crossGain, 0, c->crossGain, 0);
+	}
+	int k = 0;
+	for(; (k + 16) <= length ; k += 16){
+		__m256i x0 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(x + k)));
+		__m256i x1 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(x + k + 8)));
+		__m256i d0 = _mm256_sub_epi32(x0, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(x + k - delay))));
+		__m256i d1 = _mm256_sub_epi32(x1, _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(x + k + 8 - delay))));
+		d0 = u8iqPrefix4(d0);
+		d1 = u8iqPrefix4(d1);
+		d1 = _mm256_add_epi32(d1, _mm256_permutevar8x32_epi32(d0, lastSample));
+		__m256i s0 = _mm256_add_epi32(carry, d0);
+		__m256i s1 = _mm256_add_epi32(carry, d1);
+		carry = _mm256_permutevar8x32_epi32(s1, lastSample);
+		__m256i o;
+		if(c){
+			x0 = _mm256_sub_epi32(x0, center);
+			x1 = _mm256_sub_epi32(x1, center);
+			sum = _mm256_add_epi32(sum, _mm256_add_epi32(x0, x1));
+			power = _mm256_add_epi32(power, _mm256_add_epi32(_mm256_mullo_epi32(x0, x0), _mm256_mullo_epi32(x1, x1)));
+			cross = _mm256_add_epi32(cross, _mm256_add_epi32(_mm256_mullo_epi32(x0, _mm256_shuffle_epi32(x0, _MM_SHUFFLE(2, 3, 0, 1))), _mm256_mullo_epi32(x1, _mm256_shuffle_epi32(x1, _MM_SHUFFLE(2, 3, 0, 1)))));
+			o = _mm256_packs_epi32(u8iqCorrect8(s0, shift, offset, gain, crossGain), u8iqCorrect8(s1, shift, offset, gain, crossGain));
+		}else{
+			o = _mm256_packs_epi32(_mm256_srl_epi32(s0, shift), _mm256_srl_epi32(s1, shift));
+		}
+		o = _mm256_permute4x64_epi64(o, _MM_SHUFFLE(3, 1, 2, 0));
+		_mm_storeu_si128((__m128i *)(out + k), _mm_packus_epi16(_mm256_castsi256_si128(o), _mm256_extracti128_si256(o, 1)));
+	}
+	f->sumI = _mm256_extract_epi32(carry, 0);
+	f->sumQ = _mm256_extract_epi32(carry, 1);
+	if(c){
+		int32_t lanes[3][8];
+		_mm256_storeu_si256((__m256i *)lanes[0], sum);
+		_mm256_storeu_si256((__m256i *)lanes[1], power);
+		_mm256_storeu_si256((__m256i *)lanes[2], cross);
+		u8iqcorrectAccumulateLanes(c, lanes[0], lanes[1], lanes[2], 8, k / 2);
+	}
+	return(k);
+}
+#elif defined(__SSE2__)
+/*
+ * 4 samples per iteration, lanes are I0 Q0 I1 Q1 and I2 Q2 I3 Q3.
+ * The differences (entering - leaving) are prefix-summed inside each register
+ * then offset by the running sums of the previous samples.
+ */
+/*
+ * DC and imbalance correction of the running sums s of 2 samples: the I Q pair of each sample is
+ * duplicated so that a multiply-add by (1, 0) gives I' and by (crossGain, gain) gives Q'.
+ */
+static inline __m128i u8iqCorrect2(__m128i s0, __m128i s1, __m128i shift, __m128i offset, __m128i coefficients){
+	__m128i v0 = _mm_sub_epi32(_mm_srl_epi32(_mm_slli_epi32(s0, IQCORRECT_FRACTION), shift), offset);
+	__m128i v1 = _mm_sub_epi32(_mm_srl_epi32(_mm_slli_epi32(s1, IQCORRECT_FRACTION), shift), offset);
+	__m128i v = _mm_packs_epi32(v0, v1); // fits: at most 255 << IQCORRECT_FRACTION
+	const __m128i bias = _mm_set1_epi32(IQCORRECT_BIAS);
+	__m128i r0 = _mm_madd_epi16(_mm_unpacklo_epi32(v, v), coefficients);
+	__m128i r1 = _mm_madd_epi16(_mm_unpackhi_epi32(v, v), coefficients);
+	r0 = _mm_srai_epi32(_mm_add_epi32(r0, bias), IQCORRECT_SHIFT + IQCORRECT_FRACTION);
+	r1 = _mm_srai_epi32(_mm_add_epi32(r1, bias), IQCORRECT_SHIFT + IQCORRECT_FRACTION);
+	return(_mm_packs_epi32(r0, r1));
+}
+
+static int u8iqfilterKernel(u8iqfilter_s *f, const unsigned char *x, int length, int delay, unsigned char *out){
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i shift = _mm_cvtsi32_si128(f->logSize);
+	__m128i carry = _mm_set_epi32(f->sumQ, f->sumI, f->sumQ, f->sumI);
+	u8iqcorrect_s *c = f->correct;
+	const __m128i center = _mm_set1_epi16(128);
+	const __m128i one = _mm_set1_epi16(1);
+	__m128i offset = zero;
+	__m128i coefficients = zero;
+	// Moments per lane, at most BLOCK_SIZE samples: no overflow
+	__m128i sum = zero;
+	__m128i power = zero;
+	__m128i cross = zero;
+	if(c){
+		offset = _mm_set_epi32(c->offsetQ, c->offsetI, c->offsetQ, c->offsetI);
+		coefficients = _mm_set_epi16(c->gain, c->crossGain, 0, 1 << IQCORRECT_SHIFT, c->gain, c->crossGain, 0, 1 << IQCORRECT_SHIFT);
+	}
+	int k = 0;
+	for(; (k + 8) <= length ; k += 8){
+		__m128i entering = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(x + k)), zero);
+		__m128i leaving = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(x + k - delay)), zero);
+		__m128i d = _mm_sub_epi16(entering, leaving);
+		__m128i sign = _mm_srai_epi16(d, 15);
+		__m128i d0 = _mm_unpacklo_epi16(d, sign);
+		__m128i d1 = _mm_unpackhi_epi16(d, sign);
+		d0 = _mm_add_epi32(d0, _mm_slli_si128(d0, 8));
+		d1 = _mm_add_epi32(d1, _mm_slli_si128(d1, 8));
+		d1 = _mm_add_epi32(d1, _mm_shuffle_epi32(d0, _MM_SHUFFLE(3, 2, 3, 2)));
+		__m128i s0 = _mm_add_epi32(carry, d0);
+		__m128i s1 = _mm_add_epi32(carry, d1);
+		carry = _mm_shuffle_epi32(s1, _MM_SHUFFLE(3, 2, 3, 2));
+		__m128i o;
+		if(c){
+			// I and Q as 32-bit lanes (x, 0) of 16-bit words, squared by a multiply-add
+			__m128i e = _mm_sub_epi16(entering, center);
+			__m128i swapped = _mm_shufflehi_epi16(_mm_shufflelo_epi16(e, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+			__m128i e0 = _mm_unpacklo_epi16(e, zero);
+			__m128i e1 = _mm_unpackhi_epi16(e, zero);
+			sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_madd_epi16(e0, one), _mm_madd_epi16(e1, one)));
+			power = _mm_add_epi32(power, _mm_add_epi32(_mm_madd_epi16(e0, e0), _mm_madd_epi16(e1, e1)));
+			cross = _mm_add_epi32(cross, _mm_add_epi32(_mm_madd_epi16(e0, _mm_unpacklo_epi16(swapped, zero)), _mm_madd_epi16(e1, _mm_unpackhi_epi16(swapped, zero))));
+			o = u8iqCorrect2(s0, s1, shift, offset, coefficients);
+		}else{
+			o = _mm_packs_epi32(_mm_srl_epi32(s0, shift), _mm_srl_epi32(s1, shift));
+		}
+		_mm_storel_epi64((__m128i *)(out + k), _mm_packus_epi16(o, o));
+	}
+	f->sumI = _mm_cvtsi128_si32(carry);
+	f->sumQ = _mm_cvtsi128_si32(_mm_shuffle_epi32(carry, _MM_SHUFFLE(1, 1, 1, 1)));
+	if(c){
+		int32_t lanes[3][4];
+		_mm_storeu_si128((__m128i *)lanes[0], sum);
+		_mm_storeu_si128((__m128i *)lanes[1], power);
+		_mm_storeu_si128((__m128i *)lanes[2], cross);
+		u8iqcorrectAccumulateLanes(c, lanes[0], lanes[1], lanes[2], 4, k / 2);
+	}
+	return(k);
+}
+#else
+static int u8iqfilterKernel(u8iqfilter_s *f, const unsigned char *x, int length, int delay, unsigned char *out){
+	return(0);
+}
+#endif
+
+// Account for the byteRead bytes just read at u8iqfilterInput(), returns the number of whole sample bytes in *x
+static int u8iqfilterConsume(u8iqfilter_s *f, int byteRead, unsigned char **x){
+	*x = f->line + f->start + (2 * f->size);
+	int available = f->pending + byteRead;
+	int length = available & ~1;
+	f->start += length;
+	f->pending = available - length;
+	return(length);
+}
+
+/*
+ * Filter the byteRead bytes just read at u8iqfilterInput(), output the filtered samples.
+ * Returns the number of bytes written in out (always an even number).
+ */
+static int u8iqfilterBlock(u8iqfilter_s *f, int byteRead, unsigned char *out){
+	unsigned char *x;
+	int length = u8iqfilterConsume(f, byteRead, &x);
+	int done = u8iqfilterKernel(f, x, length, 2 * f->size, out);
+	u8iqfilterKernelScalar(f, x + done, length - done, 2 * f->size, out + done);
+	if(f->correct){
+		u8iqcorrectUpdate(f->correct);
+	}
+	return(length);
+}
+
+/*
+ * Decimating filter: CIC with 'stages' integrators at the input rate, decimation by 'decimation'
+ * and 'stages' combs at the output rate, i.e. 'stages' cascaded boxcars of 'decimation' samples
+ * of which only one output out of 'decimation' is computed.
+ * Integer only: integrators wrap around modulo 2^32, which is harmless for a CIC as long as the
+ * output range (255 * decimation^stages) fits in 32 bits. The gain is removed with a
+ * multiplication by its reciprocal.
+ */
+typedef struct {
+	int stages;
+	int decimation;
+	int phase; // input samples left before the next output
+	uint32_t integrator[2][CIC_MAX_STAGES];
+	uint32_t comb[2][CIC_MAX_STAGES];
+	uint64_t gainReciprocal; // 2^32 / decimation^stages, rounded up
+	u8iqcorrect_s *correct;  // NULL when the samples are not corrected
+} u8iqcic_s;
+
+static int u8iqcicBlock(u8iqcic_s *c, const unsigned char *x, int length, unsigned char *out);
+
+static int u8iqcicInit(u8iqcic_s *c, int decimation, int stages, unsigned char initialValue){
+	if((stages < 1) || (stages > CIC_MAX_STAGES) || (decimation < 2)){
+		return(1);
+	}
+	uint64_t gain = 1;
+	for(int i = 0 ; i < stages ; i++){
+		gain *= decimation;
+		if((gain * 255) > UINT32_MAX){
+			return(1);
+		}
+	}
+	memset(c, 0, sizeof(*c));
+	c->stages = stages;
+	c->decimation = decimation;
+	c->phase = decimation;
+	c->gainReciprocal = ((1ULL << 32) + gain - 1) / gain;
+	// Settle the filter on a constant input, so that it doesn't start from 0
+	unsigned char settle[2 * 64];
+	unsigned char discard[2 * 64];
+	memset(settle, initialValue, sizeof(settle));
+	for(int i = 0 ; i < stages * decimation ; i += 64){
+		u8iqcicBlock(c, settle, sizeof(settle), discard);
+	}
+	return(0);
+}
+
+static int u8iqcicBlock(u8iqcic_s *c, const unsigned char *x, int length, unsigned char *out){
+	int produced = 0;
+	for(int k = 0 ; k < length ; k += 2){
+		uint32_t i = x[k];
+		uint32_t q = x[k + 1];
+		if(c->correct){
+			u8iqcorrectAccumulate(c->correct, i, q);
+		}
+		for(int s = 0 ; s < c->stages ; s++){
+			i = (c->integrator[0][s] += i);
+			q = (c->integrator[1][s] += q);
+		}
+		if(0 == --c->phase){
+			c->phase = c->decimation;
+			for(int s = 0 ; s < c->stages ; s++){
+				uint32_t previousI = c->comb[0][s];
+				uint32_t previousQ = c->comb[1][s];
+				c->comb[0][s] = i;
+				c->comb[1][s] = q;
+				i -= previousI;
+				q -= previousQ;
+			}
+			if(c->correct){
+				u8iqcorrectSample(c->correct, (int)((i * c->gainReciprocal) >> (32 - IQCORRECT_FRACTION)), (int)((q * c->gainReciprocal) >> (32 - IQCORRECT_FRACTION)), out + produced);
+				produced += 2;
+			}else{
+				out[produced++] = (unsigned char)((i * c->gainReciprocal) >> 32);
+				out[produced++] = (unsigned char)((q * c->gainReciprocal) >> 32);
+			}
+		}
+	}
+	if(c->correct){
+		u8iqcorrectUpdate(c->correct);
+	}
+	return(produced);
+}
+
+static void usage(const char *name){
+	fprintf(stderr, "Usage %s [--decimate <N> [--stages <K>]] [--iqcorrect] [<filter log size>]" "\n", name);
 }
 
 int main(int argc, char *argv[]){
 	int filterLogSize = 2;
-	if(argc > 1){
-		int arg = atoi(argv[1]);
+	int decimation = 1;
+	int stages = CIC_DEFAULT_STAGES;
+	int iqCorrect = 0;
+
+	while (1){
+		int option_index = 0;
+		static struct option long_options[] = {
+		{"decimate", required_argument, 0,  'd' },
+		{"stages",   required_argument, 0,  's' },
+		{"iqcorrect", no_argument,      0,  'c' },
+		{NULL,         0,                 0,  0 }
+		};
+
+		int c = getopt_long(argc, argv, "d:s:c", long_options, &option_index);
+		if (c == -1)
+		break;
+
+		switch (c) {
+			case 'd':
+				decimation = strtol(optarg, NULL, 0);
+			break;
+			case 's':
+				stages = strtol(optarg, NULL, 0);
+			break;
+			case 'c':
+				iqCorrect = 1;
+			break;
+			default:
+				usage(argv[0]);
+				exit(1);
+			break;
+		}
+	}
+	if(optind < argc){
+		int arg = atoi(argv[optind]);
 		if(arg > 0){
 			filterLogSize = arg;
 		}
 	}
-	u8iq_sample_s input[BLOCK_SIZE];
+	if(filterLogSize > FILTER_MAX_LOG_SIZE){
+		fprintf(stderr, "%s: filter log size %d too large (max %d)" "\n", argv[0], filterLogSize, FILTER_MAX_LOG_SIZE);
+		exit(1);
+	}
+	unsigned char output[BLOCK_SIZE * sizeof(u8iq_sample_s)];
 
-	u16filter_s iFilter;
-	u16filter_s qFilter;
+	u8iqfilter_s filter;
+	u8iqcic_s cic;
+	u8iqcorrect_s correct;
+	u8iqcorrectInit(&correct);
+
+	if(decimation > 1){
+		// The CIC replaces the moving average, the delay line is only used to read whole samples
+		filterLogSize = 0;
+		if(u8iqcicInit(&cic, decimation, stages, 128)){
+			fprintf(stderr, "%s: unsupported decimation %d with %d stages (at most %d stages, %d^%d * 255 must fit in 32 bits)" "\n", argv[0], decimation, stages, CIC_MAX_STAGES, decimation, stages);
+			exit(1);
+		}
+	}
 
 	// fprintf(stderr, "filterLogSize=%d" "\n", filterLogSize);
-	u16filterInit(&iFilter, filterLogSize, 128);
-	u16filterInit(&qFilter, filterLogSize, 128);
+	if(u8iqfilterInit(&filter, filterLogSize, 128)){
+		perror(argv[0]);
+		exit(1);
+	}
+	if(iqCorrect){
+		filter.correct = &correct;
+		cic.correct = &correct;
+	}
 
 	for(;;){
-		int byteRead = read(STDIN_FILENO, input, sizeof(input));
+		int byteRead = read(STDIN_FILENO, u8iqfilterInput(&filter), sizeof(output));
 		if(byteRead > 0){
-			int sampleRead = (byteRead >> 1);
-			for(int i = 0 ; i < sampleRead ; i++){
-				input[i].I = u16filterUpdate(&iFilter, (unsigned short)(input[i].I));
-				input[i].Q = u16filterUpdate(&qFilter, (unsigned short)(input[i].Q));
+			int length;
+			if(decimation > 1){
+				unsigned char *x;
+				length = u8iqfilterConsume(&filter, byteRead, &x);
+				length = u8iqcicBlock(&cic, x, length, output);
+			}else{
+				length = u8iqfilterBlock(&filter, byteRead, output);
 			}
-			if(write(STDOUT_FILENO, input, byteRead) < 0){
+			if((length > 0) && (write(STDOUT_FILENO, output, length) < 0)){
 				break;
 			}
 		}else{
 			break;
 		}
 	}
+	u8iqfilterFree(&filter);
 }
-